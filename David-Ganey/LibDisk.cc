@@ -1,140 +1,3703 @@
 #include "LibDisk.h"
 
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#define DISK_CRC_HARDWARE
+#include <nmmintrin.h>
+#endif
+
 
 // the disk in memory (static makes it private to the file)
-static Sector* disk;
+static char* disk;
+
+// the disk geometry, picked by Disk_InitGeometry
+static int sectorSize = SECTOR_SIZE;
+static int numSectors = NUM_SECTORS;
+
+// used to see what happened w/ disk ops (each thread sees its own)
+static thread_local Disk_Error_t threadErrno;
+
+// sector I/O locks: sectors are locked 64 at a time (one dirtyBits word),
+// and the groups are spread over the stripes round robin. Whole-disk
+// operations (init, map, save, load) take every stripe.
+#define DISK_LOCK_STRIPES   64
+#define DISK_STRIPE_SECTORS 64
+typedef struct disk_stripe {
+    alignas(64) std::mutex lock;   // a cache line each, so stripes don't contend
+} Disk_Stripe;
+static Disk_Stripe stripes[DISK_LOCK_STRIPES];
+static thread_local int wholeDiskDepth = 0;
+
+// set when the disk is an mmap of an image file rather than calloc'd memory
+static int mappedFd = -1;
+static char* mappedPath = NULL;
+static size_t mappedSize = 0;
+
+// otherwise the disk is an anonymous mapping (page aligned, so it can be
+// handed straight to O_DIRECT transfers), or calloc'd memory on WIN32
+static size_t arenaSize = 0;
+
+// direct I/O: image files are read and written around the page cache, in
+// transfers that are aligned in memory and in the file
+#define DIRECT_ALIGN  4096
+#define DIRECT_CHUNK  (1 << 20)   // biggest single transfer
+static bool directIO = false;
+
+// Disk_Save and Disk_Load cut the image into IMAGE_CHUNK sized pieces (a
+// whole number of dirtyBits words for any sector size) and hand them out
+// to a few threads, each doing its own pread/pwrite at the chunk's offset
+#define IMAGE_CHUNK        (8 << 20)
+#define IMAGE_MAX_THREADS  8
+static int imageThreads = 0;    // 0 for one per core, up to IMAGE_MAX_THREADS
+
+// demand paging (Disk_OpenPaged): the disk area is only reserved address
+// space and the image file is the real disk. Sectors come in a block (one
+// OS page, or one sector if that's bigger) at a time as they're touched, at
+// most pagedLimit blocks stay resident, and a CLOCK hand picks the unpinned
+// block to drop next, writing it back first if it's dirty.
+typedef struct paged_frame {
+    size_t block;       // which block of the disk is in here, if in use
+    int pins;           // calls using the block right now; never dropped while > 0
+    bool referenced;    // touched since the hand last came by
+    bool dirty;         // written since it was paged in
+} Paged_Frame;
+static int pagedFd = -1;
+static int pagedDirectFd = -1;
+static char* pagedPath = NULL;
+static size_t pagedBlockBytes = 0;
+static size_t pagedLimit = 0;               // blocks allowed in at once, unless all of them are pinned
+static size_t pagedResident = 0;
+static size_t pagedHand = 0;
+static std::vector<Paged_Frame> pagedFrames;
+static std::vector<int> freeFrames;
+static std::vector<int> blockFrame;         // block -> frame holding it, or -1
+static std::mutex pagedLock;                // guards all of the above but the descriptors
+static unsigned int pagedSession = 0;       // bumped by every Disk_OpenPaged
+static thread_local int borrowedSector = -1;  // pinned for a Disk_ReadRef until this thread's next call
+static thread_local unsigned int borrowedSession = 0;
+
+// CRC32C of every sector, kept in a trailer after the last sector of the
+// image file; a sector's sum is checked the first time it is read after a
+// load, and kept up to date by every write
+#define SUM_MAGIC "CRC1"
+typedef struct sum_footer {
+    char magic[4];
+    int numSectors;
+} Sum_Footer;
+static unsigned int* sectorSums = NULL;
+static unsigned long long* verifiedBits = NULL;
+static bool verifyReads = true;  // Disk_SetVerifyReads
+
+// copy-on-write checkpoints, oldest first. Taking one just starts a new
+// epoch; the first write to a sector whose epoch is older than the newest
+// checkpoint's saves the old contents into that checkpoint.
+typedef struct cow_checkpoint {
+    int id;
+    unsigned int epoch;                     // sectors preserved before this one need it again
+    std::vector<char> saved;                // old sector contents, one after another
+    std::unordered_map<int, size_t> slots;  // sector -> where its old contents are in saved
+    std::vector<unsigned long long> dirty;  // dirtyBits when it was taken, for Disk_SaveCheckpoint
+} Cow_Checkpoint;
+static std::vector<Cow_Checkpoint*> checkpoints;
+static std::mutex checkpointLock;           // guards the newest checkpoint's saved sectors
+static unsigned int* sectorEpoch = NULL;
+static unsigned int cowEpoch = 0;           // the newest checkpoint's epoch, 0 if there are none
+static unsigned int lastEpoch = 0;
+static int nextCheckpointId = 0;
+
+// one bit per sector written since the disk last matched syncedPath
+static unsigned long long* dirtyBits = NULL;
+static size_t dirtyWords = 0;
+static char* syncedPath = NULL;
+
+// the async queue: requests wait in submitQueue until a worker runs them,
+// then sit in doneQueue until the caller reaps them
+#define ASYNC_MAX_WORKERS 4
+static std::mutex asyncLock;
+static std::condition_variable asyncWork;
+static std::condition_variable asyncDone;
+static std::deque<Disk_Request*> submitQueue;
+static std::deque<Disk_Request*> doneQueue;
+static std::vector<std::thread> asyncWorkers;
+static bool asyncStopping = false;
+
+// compressed image format: a header, one index entry per group of sectors,
+// then each group compressed on its own
+#define LZ_MAGIC          "LDZ1"
+#define LZ_GROUP_SECTORS  64
+#define LZ_HASH_BITS      12
+#define LZ_MIN_MATCH      4
+#define LZ_MAX_OFFSET     65535
+
+typedef struct lz_header {
+    char magic[4];
+    int sectorSize;
+    int numSectors;
+    int groupSectors;
+    int numGroups;
+} LZ_Header;
+
+typedef struct lz_group {
+    long long offset;   // where the group's bytes start in the file
+    int length;         // bytes stored, 0 for a group of all zeroes
+    int stored;         // 1 if kept uncompressed because it didn't shrink
+} LZ_Group;
+
+// striped images: the disk is cut into units of stripeSectors sectors,
+// dealt out round robin over the files (RAID 0 style). Each file ends with
+// a trailer saying which part of which disk it holds.
+#define STRIPE_MAGIC "STR1"
+typedef struct stripe_trailer {
+    char magic[4];
+    int sectorSize;
+    int numSectors;
+    int stripeSectors;
+    int numFiles;
+    int index;          // which file of the set this is
+} Stripe_Trailer;
+
+// used for statistics: each thread counts into its own shard (only it ever
+// writes there) and Disk_GetStats adds them up. Shards outlive their
+// threads so nothing counted is lost.
+typedef struct disk_stats_shard {
+    std::atomic<long long> reads, writes, seeks, seekDistance, imageBytes;
+    std::atomic<double> serviceTime, imageTime;
+} Disk_StatsShard;
+static std::mutex statsLock;            // guards statsShards and statsBase
+static std::vector<Disk_StatsShard*> statsShards;
+static Disk_Stats statsBase;            // the totals at the last Disk_ResetStats
+static thread_local Disk_StatsShard* myStats = NULL;
+static std::atomic<int> lastSector(0);
+static std::atomic<Disk_Latency_t> latencyModel(DISK_LATENCY_NONE);
+
+// latency model parameters (all times in microseconds)
+#define HDD_SETTLE_TIME      500.0     // any seek at all
+#define HDD_FULL_SEEK_TIME   8000.0    // on top of settling, for a seek across the whole disk
+#define HDD_HALF_ROTATION    4166.7    // average rotational delay at 7200 rpm
+#define HDD_BYTES_PER_US     150.0     // media transfer rate
+#define SSD_READ_TIME        25.0
+#define SSD_WRITE_TIME       200.0
+#define SSD_BYTES_PER_US     2000.0
+
+/*
+ * Disk_Addr
+ *
+ * Where a sector lives in the disk area.
+ */
+static inline char* Disk_Addr(int sector)
+{
+    return disk + (size_t) sector * sectorSize;
+}
+
+/*
+ * Disk_Bytes
+ *
+ * Size of the whole disk image.
+ */
+static inline size_t Disk_Bytes()
+{
+    return (size_t) numSectors * sectorSize;
+}
+
+/*
+ * Disk_SetSynced
+ *
+ * Records that the disk now matches the given file exactly (or nothing,
+ * for NULL) and forgets every dirty sector.
+ */
+static void Disk_SetSynced(const char* file)
+{
+    if (syncedPath != file) {
+        free(syncedPath);
+        syncedPath = (file == NULL) ? NULL : strdup(file);
+    }
+    if (dirtyBits != NULL) {
+        memset(dirtyBits, 0, dirtyWords * sizeof(unsigned long long));
+    }
+}
+
+/*
+ * Disk_ClearDirty
+ *
+ * Forgets that "count" sectors starting at "sector" need saving.
+ */
+static void Disk_ClearDirty(int sector, int count)
+{
+    for (int i = sector; i < sector + count; i++) {
+        dirtyBits[i / 64] &= ~(1ULL << (i % 64));
+    }
+}
+
+/*
+ * Disk_Ctz
+ *
+ * Index of the lowest set bit of a non-zero word.
+ */
+static int Disk_Ctz(unsigned long long word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return (int) index;
+#else
+    return __builtin_ctzll(word);
+#endif
+}
+
+/*
+ * Disk_SectorStripe
+ *
+ * The stripe lock bit covering a sector.
+ */
+static inline unsigned long long Disk_SectorStripe(int sector)
+{
+    return 1ULL << ((sector / DISK_STRIPE_SECTORS) % DISK_LOCK_STRIPES);
+}
+
+/*
+ * Disk_RangeStripes
+ *
+ * The stripe lock bits covering "count" sectors starting at "sector".
+ */
+static unsigned long long Disk_RangeStripes(int sector, int count)
+{
+    unsigned long long mask = 0;
+    if (count <= 0) {
+        return 0;
+    }
+    int first = sector / DISK_STRIPE_SECTORS;
+    int last = (sector + count - 1) / DISK_STRIPE_SECTORS;
+    for (int group = first; group <= last && group < first + DISK_LOCK_STRIPES; group++) {
+        mask |= 1ULL << (group % DISK_LOCK_STRIPES);
+    }
+    return mask;
+}
+
+/*
+ * Disk_LockStripes
+ *
+ * Takes the stripe locks in "mask", always lowest first so two callers
+ * can't deadlock. Does nothing inside a whole-disk operation, which
+ * already holds them all.
+ */
+static void Disk_LockStripes(unsigned long long mask)
+{
+    if (wholeDiskDepth > 0) {
+        return;
+    }
+    for (; mask != 0; mask &= mask - 1) {
+        stripes[Disk_Ctz(mask)].lock.lock();
+    }
+}
+
+/*
+ * Disk_UnlockStripes
+ *
+ * Drops the stripe locks taken by Disk_LockStripes.
+ */
+static void Disk_UnlockStripes(unsigned long long mask)
+{
+    if (wholeDiskDepth > 0) {
+        return;
+    }
+    for (; mask != 0; mask &= mask - 1) {
+        stripes[Disk_Ctz(mask)].lock.unlock();
+    }
+}
+
+// holds some stripe locks for as long as it's in scope
+struct Disk_StripeGuard {
+    unsigned long long mask;
+    Disk_StripeGuard(unsigned long long m) : mask(m) { Disk_LockStripes(mask); }
+    ~Disk_StripeGuard() { Disk_UnlockStripes(mask); }
+};
+
+// holds every stripe lock for as long as it's in scope; whole-disk
+// operations can nest (e.g. Disk_SaveIncremental falling back to Disk_Save)
+struct Disk_WholeDiskGuard {
+    Disk_WholeDiskGuard() { Disk_LockStripes(~0ULL); wholeDiskDepth++; }
+    ~Disk_WholeDiskGuard() { wholeDiskDepth--; Disk_UnlockStripes(~0ULL); }
+};
+
+/*
+ * Disk_NextDirtyRun
+ *
+ * Finds the next run of consecutive dirty sectors at or after "from".
+ * Returns the run length (0 when there are none left) and the first
+ * sector of the run through "start".
+ */
+static int Disk_NextDirtyRun(int from, int* start)
+{
+    int sector = from;
+
+    // skip clean words whole
+    while (sector < numSectors) {
+        unsigned long long word = dirtyBits[sector / 64] >> (sector % 64);
+        if (word != 0) {
+            sector += Disk_Ctz(word);
+            break;
+        }
+        sector = (sector / 64 + 1) * 64;
+    }
+    if (sector >= numSectors) {
+        return 0;
+    }
+
+    *start = sector;
+    while (sector < numSectors && (dirtyBits[sector / 64] >> (sector % 64)) & 1) {
+        sector++;
+    }
+    return sector - *start;
+}
+
+/*
+ * Disk_Crc32cTable
+ *
+ * CRC32C (Castagnoli) a byte at a time from a table built on first use.
+ */
+static unsigned int Disk_Crc32cTable(unsigned int crc, const unsigned char* data, size_t length)
+{
+    static const std::vector<unsigned int> table = [] {
+        std::vector<unsigned int> built(256);
+        for (unsigned int i = 0; i < 256; i++) {
+            unsigned int entry = i;
+            for (int bit = 0; bit < 8; bit++) {
+                entry = (entry & 1) ? (entry >> 1) ^ 0x82F63B78 : entry >> 1;
+            }
+            built[i] = entry;
+        }
+        return built;
+    }();
+
+    for (size_t i = 0; i < length; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef DISK_CRC_HARDWARE
+/*
+ * Disk_Crc32cHardware
+ *
+ * CRC32C 8 bytes at a time with the SSE4.2 crc32 instruction.
+ */
+__attribute__((target("sse4.2")))
+static unsigned int Disk_Crc32cHardware(unsigned int crc, const unsigned char* data, size_t length)
+{
+    unsigned long long crc64 = crc;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        unsigned long long word;
+        memcpy(&word, data + i, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (unsigned int) crc64;
+    for (; i < length; i++) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * Disk_Crc32c
+ *
+ * CRC32C of a buffer, in hardware when the CPU has SSE4.2.
+ */
+static unsigned int Disk_Crc32c(const char* data, size_t length)
+{
+#ifdef DISK_CRC_HARDWARE
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) {
+        return ~Disk_Crc32cHardware(~0U, (const unsigned char*) data, length);
+    }
+#endif
+    return ~Disk_Crc32cTable(~0U, (const unsigned char*) data, length);
+}
+
+/*
+ * Disk_SumBytes
+ *
+ * Size of the checksum trailer that follows the sectors in an image file.
+ */
+static inline size_t Disk_SumBytes()
+{
+    return (size_t) numSectors * sizeof(unsigned int) + sizeof(Sum_Footer);
+}
+
+/*
+ * Disk_UpdateSum
+ *
+ * Recomputes a sector's checksum after it was written.
+ */
+static inline void Disk_UpdateSum(int sector)
+{
+    sectorSums[sector] = Disk_Crc32c(Disk_Addr(sector), sectorSize);
+    verifiedBits[sector / 64] |= 1ULL << (sector % 64);
+}
+
+/*
+ * Disk_CheckSum
+ *
+ * Makes sure a sector still matches its checksum, the first time it is
+ * read since the disk was loaded. Only the first time: in memory a sector
+ * only changes through a write, which redoes its sum, so it can only go bad
+ * on its way through a file (and checking every read would cost about as
+ * much as the copy itself).
+ */
+static inline int Disk_CheckSum(int sector)
+{
+    if (!verifyReads || ((verifiedBits[sector / 64] >> (sector % 64)) & 1)) {
+        return 0;
+    }
+    if (Disk_Crc32c(Disk_Addr(sector), sectorSize) != sectorSums[sector]) {
+        diskErrno = E_CHECKSUM;
+        return -1;
+    }
+    verifiedBits[sector / 64] |= 1ULL << (sector % 64);
+    return 0;
+}
+
+/*
+ * Disk_ComputeAllSums
+ *
+ * Checksums the whole disk from scratch (for images without a trailer).
+ */
+static void Disk_ComputeAllSums()
+{
+    for (int i = 0; i < numSectors; i++) {
+        Disk_UpdateSum(i);
+    }
+}
+
+/*
+ * Disk_FillZeroSums
+ *
+ * Sets every checksum to that of an all-zero sector.
+ */
+static void Disk_FillZeroSums()
+{
+    std::vector<char> zero(sectorSize, 0);
+    unsigned int sum = Disk_Crc32c(zero.data(), sectorSize);
+    for (int i = 0; i < numSectors; i++) {
+        sectorSums[i] = sum;
+    }
+    memset(verifiedBits, 0xff, dirtyWords * sizeof(unsigned long long));
+}
+
+/*
+ * Disk_FooterMatches
+ *
+ * True if a trailer footer says it belongs to a disk like this one.
+ */
+static inline bool Disk_FooterMatches(const Sum_Footer* footer)
+{
+    return memcmp(footer->magic, SUM_MAGIC, 4) == 0 && footer->numSectors == numSectors;
+}
+
+/*
+ * Disk_MarkDirty
+ *
+ * Remembers that a sector needs saving.
+ */
+static inline void Disk_MarkDirty(int sector)
+{
+    dirtyBits[sector / 64] |= 1ULL << (sector % 64);
+}
+
+/*
+ * Disk_Bump
+ *
+ * Adds to a counter in this thread's stats shard. Only the owning thread
+ * writes a shard, so a plain load and store is enough (no locked add).
+ */
+template <typename T>
+static inline void Disk_Bump(std::atomic<T>& counter, T amount)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/*
+ * Disk_MyStats
+ *
+ * The calling thread's stats shard, made the first time it's needed.
+ */
+static Disk_StatsShard& Disk_MyStats()
+{
+    if (myStats == NULL) {
+        myStats = new Disk_StatsShard();
+        std::lock_guard<std::mutex> guard(statsLock);
+        statsShards.push_back(myStats);
+    }
+    return *myStats;
+}
+
+/*
+ * Disk_Account
+ *
+ * Counts one request for "count" consecutive sectors starting at "sector"
+ * and charges it to the simulated service time of the latency model.
+ */
+static void Disk_Account(int sector, int count, bool write)
+{
+    // the head ends up just past what it transferred; whoever got there
+    // before us decides where it started from
+    int from = lastSector.load(std::memory_order_relaxed);
+    if (from != sector) {
+        from = lastSector.exchange(sector + count, std::memory_order_relaxed);
+    } else {
+        lastSector.store(sector + count, std::memory_order_relaxed);
+    }
+    long long distance = (sector > from) ? sector - from : from - sector;
+    double bytes = (double) count * sectorSize;
+    double serviceTime = 0;
+
+    Disk_StatsShard& stats = Disk_MyStats();
+
+    if (write) {
+        Disk_Bump(stats.writes, (long long) count);
+    } else {
+        Disk_Bump(stats.reads, (long long) count);
+    }
+    if (distance != 0) {
+        Disk_Bump(stats.seeks, 1LL);
+        Disk_Bump(stats.seekDistance, distance);
+    }
+
+    switch (latencyModel.load(std::memory_order_relaxed)) {
+    case DISK_LATENCY_HDD:
+        if (distance != 0) {
+            // short seeks are dominated by settling, long ones grow with the square root of the distance
+            serviceTime += HDD_SETTLE_TIME + HDD_FULL_SEEK_TIME * sqrt((double) distance / numSectors);
+            serviceTime += HDD_HALF_ROTATION;
+        }
+        serviceTime += bytes / HDD_BYTES_PER_US;
+        break;
+    case DISK_LATENCY_SSD:
+        serviceTime += (write ? SSD_WRITE_TIME : SSD_READ_TIME) + bytes / SSD_BYTES_PER_US;
+        break;
+    default:
+        break;
+    }
+    if (serviceTime != 0) {
+        Disk_Bump(stats.serviceTime, serviceTime);
+    }
+}
+
+/*
+ * Disk_SectorIsZero
+ *
+ * True if every byte of the sector is 0. ORs the sector together 16
+ * bytes at a time where SSE2 is around, 8 at a time otherwise.
+ */
+static bool Disk_SectorIsZero(int sector)
+{
+    const char* data = Disk_Addr(sector);
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i acc = _mm_setzero_si128();
+    for (int i = 0; i < sectorSize; i += 64) {
+        __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i)), _mm_loadu_si128((const __m128i*)(data + i + 16)));
+        __m128i b = _mm_or_si128(_mm_loadu_si128((const __m128i*)(data + i + 32)), _mm_loadu_si128((const __m128i*)(data + i + 48)));
+        acc = _mm_or_si128(acc, _mm_or_si128(a, b));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xffff;
+#else
+    unsigned long long acc = 0;
+    for (int i = 0; i < sectorSize; i += sizeof(acc)) {
+        unsigned long long word;
+        memcpy(&word, data + i, sizeof(word));
+        acc |= word;
+    }
+    return acc == 0;
+#endif
+}
+
+#ifndef WIN32
+/*
+ * Disk_PWriteAll / Disk_PReadAll
+ *
+ * pwrite/pread that keep going until everything is moved.
+ */
+static int Disk_PWriteAll(int fd, const char* from, size_t left, off_t offset)
+{
+    while (left > 0) {
+        ssize_t moved = pwrite(fd, from, left, offset);
+        if (moved <= 0) {
+            return -1;
+        }
+        from += moved;
+        offset += moved;
+        left -= moved;
+    }
+    return 0;
+}
+
+static int Disk_PReadAll(int fd, char* to, size_t left, off_t offset)
+{
+    while (left > 0) {
+        ssize_t moved = pread(fd, to, left, offset);
+        if (moved <= 0) {
+            return -1;
+        }
+        to += moved;
+        offset += moved;
+        left -= moved;
+    }
+    return 0;
+}
+
+/*
+ * Disk_OpenDirect
+ *
+ * Opens the image a second time for direct I/O if that mode is on. -1
+ * means use the normal descriptor (mode off, or the filesystem won't do
+ * O_DIRECT).
+ */
+static int Disk_OpenDirect(const char* file, int flags)
+{
+#ifdef O_DIRECT
+    if (directIO) {
+        return open(file, flags | O_DIRECT);
+    }
+#endif
+    return -1;
+}
+
+/*
+ * Disk_TransferSpan
+ *
+ * Moves bytes [from, to) of the disk area to or from the image. Without a
+ * direct descriptor that's a plain pwrite/pread on "fd". With one, the span
+ * is widened to whole DIRECT_ALIGN blocks (the disk area and the image
+ * agree on the extra bytes, or the image is what's wanted for a load) and
+ * moved in DIRECT_CHUNK pieces around the page cache; only the partial
+ * block at the very end of the disk goes through "fd".
+ */
+static int Disk_TransferSpan(int fd, int directFd, size_t from, size_t to, bool write)
+{
+    if (directFd == -1) {
+        return write ? Disk_PWriteAll(fd, disk + from, to - from, (off_t) from)
+                     : Disk_PReadAll(fd, disk + from, to - from, (off_t) from);
+    }
+
+    size_t wholeBlocks = Disk_Bytes() / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t start = from / DIRECT_ALIGN * DIRECT_ALIGN;
+    size_t end = (to + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (end > wholeBlocks) {
+        end = wholeBlocks;
+    }
+    for (size_t at = start; at < end; at += DIRECT_CHUNK) {
+        size_t length = (end - at < DIRECT_CHUNK) ? end - at : DIRECT_CHUNK;
+        int moved = write ? Disk_PWriteAll(directFd, disk + at, length, (off_t) at)
+                          : Disk_PReadAll(directFd, disk + at, length, (off_t) at);
+        if (moved == -1) {
+            return -1;
+        }
+    }
+
+    size_t rest = (end > from) ? end : from;
+    if (rest < to) {
+        return write ? Disk_PWriteAll(fd, disk + rest, to - rest, (off_t) rest)
+                     : Disk_PReadAll(fd, disk + rest, to - rest, (off_t) rest);
+    }
+    return 0;
+}
+
+/*
+ * Disk_RunChunks
+ *
+ * Calls worker(first, count) on every IMAGE_CHUNK worth of sectors, from
+ * the caller and up to imageThreads - 1 more threads, each taking the next
+ * chunk nobody has yet. Stops handing out chunks once one fails. Workers
+ * run under the caller's whole-disk guard, and no two of them ever touch
+ * the same dirtyBits word.
+ */
+template <typename Worker>
+static int Disk_RunChunks(Worker worker)
+{
+    int perChunk = IMAGE_CHUNK / sectorSize;
+    int chunks = (numSectors + perChunk - 1) / perChunk;
+    int threads = imageThreads;
+    if (threads == 0) {
+        threads = (int) std::thread::hardware_concurrency();
+        threads = (threads < 1) ? 1 : (threads > IMAGE_MAX_THREADS) ? IMAGE_MAX_THREADS : threads;
+    }
+    if (threads > chunks) {
+        threads = chunks;
+    }
+
+    std::atomic<int> next(0);
+    std::atomic<bool> failed(false);
+    auto run = [&]() {
+        int chunk;
+        while (!failed.load(std::memory_order_relaxed) && (chunk = next.fetch_add(1)) < chunks) {
+            int first = chunk * perChunk;
+            int count = (numSectors - first < perChunk) ? numSectors - first : perChunk;
+            if (worker(first, count) == -1) {
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> helpers;
+    for (int i = 1; i < threads; i++) {
+        helpers.push_back(std::thread(run));
+    }
+    run();
+    for (size_t i = 0; i < helpers.size(); i++) {
+        helpers[i].join();
+    }
+    return failed ? -1 : 0;
+}
+
+/*
+ * Disk_RecordTransfer
+ *
+ * Counts a finished image save or load towards the throughput stats.
+ */
+static void Disk_RecordTransfer(long long bytes, std::chrono::steady_clock::time_point start)
+{
+    Disk_StatsShard& stats = Disk_MyStats();
+    Disk_Bump(stats.imageBytes, bytes);
+    Disk_Bump(stats.imageTime, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+/*
+ * Disk_BlockEnd
+ *
+ * Where a paged block ends in the disk area (the last one can be short).
+ */
+static inline size_t Disk_BlockEnd(size_t block)
+{
+    size_t end = (block + 1) * pagedBlockBytes;
+    return (end < Disk_Bytes()) ? end : Disk_Bytes();
+}
+
+/*
+ * Disk_PagedWriteBack
+ *
+ * Writes a dirty resident block, and its sectors' checksums, to the image.
+ */
+static int Disk_PagedWriteBack(Paged_Frame& frame)
+{
+    size_t from = frame.block * pagedBlockBytes;
+    size_t to = Disk_BlockEnd(frame.block);
+    int first = (int)(from / sectorSize);
+    int count = (int)((to - from) / sectorSize);
+
+    if (Disk_TransferSpan(pagedFd, pagedDirectFd, from, to, true) == -1 ||
+        Disk_PWriteAll(pagedFd, (char*)(sectorSums + first), (size_t) count * sizeof(unsigned int),
+                       (off_t)(Disk_Bytes() + (size_t) first * sizeof(unsigned int))) == -1) {
+        return -1;
+    }
+    frame.dirty = false;
+    return 0;
+}
+
+/*
+ * Disk_PagedEvict
+ *
+ * Runs the CLOCK hand until it finds a block nobody has pinned or touched
+ * since its last pass, and drops it. Returns the frame it freed, or -1 if
+ * everything resident is pinned (or won't write back).
+ */
+static int Disk_PagedEvict()
+{
+    for (size_t swept = 0; swept < 2 * pagedFrames.size(); swept++) {
+        int slot = (int) pagedHand;
+        Paged_Frame& frame = pagedFrames[slot];
+        pagedHand = (pagedHand + 1) % pagedFrames.size();
+        if (blockFrame[frame.block] != slot || frame.pins > 0) {
+            continue;
+        }
+        if (frame.referenced) {
+            frame.referenced = false;
+            continue;
+        }
+        if (frame.dirty && Disk_PagedWriteBack(frame) == -1) {
+            continue; // better over the limit than losing the data
+        }
+
+        madvise(disk + frame.block * pagedBlockBytes, pagedBlockBytes, MADV_DONTNEED);
+        blockFrame[frame.block] = -1;
+        pagedResident--;
+        return slot;
+    }
+    return -1;
+}
+
+/*
+ * Disk_PagedFault
+ *
+ * Reads a block in from the image, making room for it first if the
+ * resident set is full. Returns its frame or -1.
+ */
+static int Disk_PagedFault(size_t block)
+{
+    int slot = -1;
+    if (pagedResident >= pagedLimit) {
+        slot = Disk_PagedEvict();
+    }
+    if (slot == -1 && !freeFrames.empty()) {
+        slot = freeFrames.back();
+        freeFrames.pop_back();
+    }
+    if (slot == -1) {
+        pagedFrames.push_back(Paged_Frame());
+        slot = (int) pagedFrames.size() - 1;
+    }
+
+    size_t from = block * pagedBlockBytes;
+    if (Disk_TransferSpan(pagedFd, pagedDirectFd, from, Disk_BlockEnd(block), false) == -1) {
+        madvise(disk + from, pagedBlockBytes, MADV_DONTNEED);
+        freeFrames.push_back(slot);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    // what came in gets checked against its checksums again when read
+    for (size_t i = from / sectorSize; i < Disk_BlockEnd(block) / sectorSize; i++) {
+        verifiedBits[i / 64] &= ~(1ULL << (i % 64));
+    }
+    Paged_Frame& frame = pagedFrames[slot];
+    frame.block = block;
+    frame.pins = 0;
+    frame.referenced = true;
+    frame.dirty = false;
+    blockFrame[block] = slot;
+    pagedResident++;
+    return slot;
+}
+
+/*
+ * Disk_PagedUnpinBlocks
+ *
+ * Lets go of blocks "first" to "last" (pagedLock held).
+ */
+static void Disk_PagedUnpinBlocks(size_t first, size_t last)
+{
+    for (size_t block = first; block <= last; block++) {
+        pagedFrames[blockFrame[block]].pins--;
+    }
+}
+
+/*
+ * Disk_PagedDropBorrowed
+ *
+ * Unpins the sector this thread last got from Disk_ReadRef, if any (pagedLock held).
+ */
+static void Disk_PagedDropBorrowed()
+{
+    if (borrowedSector != -1 && borrowedSession == pagedSession) {
+        size_t block = (size_t) borrowedSector * sectorSize / pagedBlockBytes;
+        Disk_PagedUnpinBlocks(block, block);
+    }
+    borrowedSector = -1;
+}
+
+/*
+ * Disk_PagedFlush
+ *
+ * Writes back every dirty resident block holding one of "count" sectors
+ * starting at "sector".
+ */
+static int Disk_PagedFlush(int sector, int count)
+{
+    std::lock_guard<std::mutex> guard(pagedLock);
+    size_t first = (size_t) sector * sectorSize / pagedBlockBytes;
+    size_t end = ((size_t)(sector + count) * sectorSize + pagedBlockBytes - 1) / pagedBlockBytes;
+    int result = 0;
+
+    for (size_t i = 0; i < pagedFrames.size(); i++) {
+        Paged_Frame& frame = pagedFrames[i];
+        if (blockFrame[frame.block] == (int) i && frame.dirty && frame.block >= first && frame.block < end &&
+            Disk_PagedWriteBack(frame) == -1) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/*
+ * Disk_PagedDropAll
+ *
+ * Forgets every resident block without writing anything back.
+ */
+static void Disk_PagedDropAll()
+{
+    std::lock_guard<std::mutex> guard(pagedLock);
+    if (disk != NULL) {
+        madvise(disk, arenaSize, MADV_DONTNEED);
+    }
+    std::fill(blockFrame.begin(), blockFrame.end(), -1);
+    pagedFrames.clear();
+    freeFrames.clear();
+    pagedResident = 0;
+    pagedHand = 0;
+    pagedSession++; // outstanding Disk_ReadRef pins are gone too
+}
+
+/*
+ * Disk_SumImage
+ *
+ * Checksums every sector of an image file without keeping it in memory,
+ * a DIRECT_CHUNK at a time; chunks that are all hole aren't read at all.
+ */
+static int Disk_SumImage(int fd, unsigned int* sums)
+{
+    std::vector<char> chunk(DIRECT_CHUNK);
+    std::vector<char> zero(sectorSize, 0);
+    unsigned int zeroSum = Disk_Crc32c(zero.data(), sectorSize);
+    int perChunk = DIRECT_CHUNK / sectorSize;
+
+    for (int first = 0; first < numSectors; first += perChunk) {
+        int count = (numSectors - first < perChunk) ? numSectors - first : perChunk;
+        off_t offset = (off_t) first * sectorSize;
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if ((data == -1 && errno == ENXIO) || data >= offset + (off_t) count * sectorSize) {
+            for (int i = first; i < first + count; i++) {
+                sums[i] = zeroSum;
+            }
+            continue;
+        }
+        if (Disk_PReadAll(fd, chunk.data(), (size_t) count * sectorSize, offset) == -1) {
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            sums[first + i] = Disk_Crc32c(&chunk[(size_t) i * sectorSize], sectorSize);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Disk_PagedLoadSums
+ *
+ * Gets the checksums of an image that's about to be paged from its
+ * trailer, or works them out and gives the image a trailer.
+ */
+static int Disk_PagedLoadSums(int fd, size_t fileSize, unsigned int* sums)
+{
+    Sum_Footer footer;
+    if (fileSize >= Disk_Bytes() + Disk_SumBytes() &&
+        Disk_PReadAll(fd, (char*) sums, (size_t) numSectors * sizeof(unsigned int), (off_t) Disk_Bytes()) == 0 &&
+        Disk_PReadAll(fd, (char*) &footer, sizeof(Sum_Footer), (off_t)(Disk_Bytes() + Disk_SumBytes() - sizeof(Sum_Footer))) == 0 &&
+        Disk_FooterMatches(&footer)) {
+        return 0;
+    }
+
+    if (Disk_SumImage(fd, sums) == -1) {
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+    memcpy(footer.magic, SUM_MAGIC, 4);
+    footer.numSectors = numSectors;
+    if (Disk_PWriteAll(fd, (char*) sums, (size_t) numSectors * sizeof(unsigned int), (off_t) Disk_Bytes()) == -1 ||
+        Disk_PWriteAll(fd, (char*) &footer, sizeof(Sum_Footer), (off_t)(Disk_Bytes() + Disk_SumBytes() - sizeof(Sum_Footer))) == -1) {
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Disk_CopyImage
+ *
+ * Copies the first "size" bytes of one image file over another, which ends
+ * up a whole image long. All-zero chunks are left as holes.
+ */
+static int Disk_CopyImage(int from, int to, size_t size)
+{
+    std::vector<char> chunk(DIRECT_CHUNK);
+    std::vector<char> zero(DIRECT_CHUNK, 0);
+
+    if (ftruncate(to, 0) == -1 || ftruncate(to, (off_t)(Disk_Bytes() + Disk_SumBytes())) == -1) {
+        return -1;
+    }
+    for (size_t at = 0; at < size; at += DIRECT_CHUNK) {
+        size_t length = (size - at < DIRECT_CHUNK) ? size - at : DIRECT_CHUNK;
+        if (Disk_PReadAll(from, chunk.data(), length, (off_t) at) == -1) {
+            return -1;
+        }
+        if (memcmp(chunk.data(), zero.data(), length) != 0 &&
+            Disk_PWriteAll(to, chunk.data(), length, (off_t) at) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Disk_PunchHole
+ *
+ * Deallocates the file space behind "count" sectors starting at "sector";
+ * they read back as zeroes. Fails where the filesystem can't do that.
+ */
+static int Disk_PunchHole(int fd, int sector, int count)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t) sector * sectorSize, (off_t) count * sectorSize);
+#else
+    return -1;
+#endif
+}
+
+/*
+ * Disk_ZeroSpan
+ *
+ * Zeroes bytes [from, to) of the anonymous disk area, handing whole pages
+ * back to the kernel instead of writing them (they come back zeroed).
+ */
+static void Disk_ZeroSpan(size_t from, size_t to)
+{
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t start = (from + page - 1) / page * page;
+    size_t end = to / page * page;
+    if (start >= end) {
+        memset(disk + from, 0, to - from);
+        return;
+    }
+    memset(disk + from, 0, start - from);
+    madvise(disk + start, end - start, MADV_DONTNEED);
+    memset(disk + end, 0, to - end);
+}
+#endif
+
+/*
+ * Disk_PinSectors
+ *
+ * On a paged disk, brings in the blocks holding "count" sectors starting
+ * at "sector" and keeps them resident until Disk_UnpinSectors; "write"
+ * marks them as needing write back. The caller holds the sectors' stripe
+ * locks. Anything else is always resident, so there's nothing to do.
+ */
+static int Disk_PinSectors(int sector, int count, bool write)
+{
+    if (pagedFd == -1 || count <= 0) {
+        return 0;
+    }
+#ifndef WIN32
+    std::lock_guard<std::mutex> guard(pagedLock);
+    Disk_PagedDropBorrowed();
+
+    size_t first = (size_t) sector * sectorSize / pagedBlockBytes;
+    size_t last = ((size_t)(sector + count) * sectorSize - 1) / pagedBlockBytes;
+    for (size_t block = first; block <= last; block++) {
+        int slot = blockFrame[block];
+        if (slot == -1 && (slot = Disk_PagedFault(block)) == -1) {
+            if (block > first) {
+                Disk_PagedUnpinBlocks(first, block - 1);
+            }
+            return -1;
+        }
+        Paged_Frame& frame = pagedFrames[slot];
+        frame.pins++;
+        frame.referenced = true;
+        frame.dirty = frame.dirty || write;
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Disk_UnpinSectors
+ *
+ * Undoes Disk_PinSectors.
+ */
+static void Disk_UnpinSectors(int sector, int count)
+{
+    if (pagedFd == -1 || count <= 0) {
+        return;
+    }
+#ifndef WIN32
+    std::lock_guard<std::mutex> guard(pagedLock);
+    Disk_PagedUnpinBlocks((size_t) sector * sectorSize / pagedBlockBytes,
+                          ((size_t)(sector + count) * sectorSize - 1) / pagedBlockBytes);
+#endif
+}
+
+/*
+ * Disk_BorrowSector
+ *
+ * Keeps a pinned sector pinned past the end of the call, for Disk_ReadRef;
+ * this thread's next pin lets it go.
+ */
+static void Disk_BorrowSector(int sector)
+{
+    if (pagedFd == -1) {
+        return;
+    }
+#ifndef WIN32
+    std::lock_guard<std::mutex> guard(pagedLock);
+    pagedFrames[blockFrame[(size_t) sector * sectorSize / pagedBlockBytes]].pins++;
+    borrowedSector = sector;
+    borrowedSession = pagedSession;
+#endif
+}
+
+// keeps some sectors of a paged disk resident for as long as it's in scope
+struct Disk_PageGuard {
+    int sector, count;
+    bool failed;
+    Disk_PageGuard(int s, int c, bool write) : sector(s), count(c) { failed = (Disk_PinSectors(sector, count, write) == -1); }
+    ~Disk_PageGuard() { if (!failed) Disk_UnpinSectors(sector, count); }
+};
+
+#ifndef WIN32
+/*
+ * Disk_PagedDiscard
+ *
+ * Zeroes "count" sectors starting at "sector" of a paged disk. Resident
+ * blocks they cover whole are just dropped (the caller punches the file),
+ * and only blocks they cover in part get paged in.
+ */
+static int Disk_PagedDiscard(int sector, int count)
+{
+    size_t from = (size_t) sector * sectorSize;
+    size_t to = (size_t)(sector + count) * sectorSize;
+    size_t firstWhole = (from + pagedBlockBytes - 1) / pagedBlockBytes;
+    size_t endWhole = (to == Disk_Bytes()) ? blockFrame.size() : to / pagedBlockBytes;
+
+    {
+        std::lock_guard<std::mutex> guard(pagedLock);
+        for (size_t block = firstWhole; block < endWhole; block++) {
+            int slot = blockFrame[block];
+            if (slot == -1) {
+                continue;
+            }
+            if (pagedFrames[slot].pins > 0) {
+                // somebody has it borrowed, so it stays, zeroed
+                memset(disk + block * pagedBlockBytes, 0, Disk_BlockEnd(block) - block * pagedBlockBytes);
+                pagedFrames[slot].dirty = true;
+                continue;
+            }
+            madvise(disk + block * pagedBlockBytes, pagedBlockBytes, MADV_DONTNEED);
+            blockFrame[block] = -1;
+            freeFrames.push_back(slot);
+            pagedResident--;
+        }
+    }
+
+    // the ends that only cover part of a block
+    size_t heads[2] = { from, to };
+    size_t tails[2] = { to, to };
+    if (firstWhole < endWhole) {
+        tails[0] = firstWhole * pagedBlockBytes;
+        heads[1] = std::min(endWhole * pagedBlockBytes, to);
+    }
+    for (int i = 0; i < 2; i++) {
+        if (heads[i] >= tails[i]) {
+            continue;
+        }
+        int first = (int)(heads[i] / sectorSize);
+        int span = (int)((tails[i] - heads[i]) / sectorSize);
+        if (Disk_PinSectors(first, span, true) == -1) {
+            return -1;
+        }
+        memset(disk + heads[i], 0, tails[i] - heads[i]);
+        Disk_UnpinSectors(first, span);
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Disk_Preserve
+ *
+ * Called before a sector is changed: if the newest checkpoint doesn't have
+ * the sector's old contents yet, they're saved there first.
+ */
+static inline void Disk_Preserve(int sector)
+{
+    if (sectorEpoch[sector] >= cowEpoch) {
+        return; // no checkpoint, or already saved since the newest one
+    }
+
+    Cow_Checkpoint* newest = checkpoints.back();
+    std::lock_guard<std::mutex> guard(checkpointLock);
+    newest->slots[sector] = newest->saved.size();
+    newest->saved.insert(newest->saved.end(), Disk_Addr(sector), Disk_Addr(sector) + sectorSize);
+    sectorEpoch[sector] = cowEpoch;
+}
+
+/*
+ * Disk_FindCheckpoint
+ *
+ * Where a checkpoint handle is in the list, or -1.
+ */
+static int Disk_FindCheckpoint(int id)
+{
+    for (size_t i = 0; i < checkpoints.size(); i++) {
+        if (checkpoints[i]->id == id) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Disk_DropCheckpoints
+ *
+ * Throws away every checkpoint from "from" on (everything for 0).
+ */
+static void Disk_DropCheckpoints(size_t from)
+{
+    while (checkpoints.size() > from) {
+        delete checkpoints.back();
+        checkpoints.pop_back();
+    }
+    cowEpoch = checkpoints.empty() ? 0 : checkpoints.back()->epoch;
+}
+
+/*
+ * Disk_Release
+ *
+ * Frees or unmaps the current disk area.
+ */
+static void Disk_Release()
+{
+    Disk_DropCheckpoints(0);
+
+#ifndef WIN32
+    if (mappedFd != -1) {
+        munmap(disk, mappedSize);
+        close(mappedFd);
+        free(mappedPath);
+        mappedFd = -1;
+        mappedPath = NULL;
+        mappedSize = 0;
+        disk = NULL;
+        sectorSums = NULL; // lived in the mapping
+    }
+    if (pagedFd != -1) {
+        // the file is the disk, so it gets whatever is still only in memory
+        Disk_PagedFlush(0, numSectors);
+        close(pagedFd);
+        if (pagedDirectFd != -1) {
+            close(pagedDirectFd);
+        }
+        free(pagedPath);
+        pagedFd = -1;
+        pagedDirectFd = -1;
+        pagedPath = NULL;
+        Disk_PagedDropAll();
+        blockFrame.clear();
+    }
+    if (disk != NULL) {
+        munmap(disk, arenaSize);
+    }
+#else
+    free(disk);
+#endif
+    free(sectorSums);
+    disk = NULL;
+    arenaSize = 0;
+    sectorSums = NULL;
+    Disk_SetSynced(NULL);
+}
+
+/*
+ * Disk_Errno
+ *
+ * Where the calling thread's diskErrno lives.
+ */
+Disk_Error_t* Disk_Errno()
+{
+    return &threadErrno;
+}
+
+/*
+ * Disk_Init
+ *
+ * Initializes the disk area (really just some memory for now) with the
+ * default geometry of NUM_SECTORS sectors of SECTOR_SIZE bytes.
+ *
+ * THIS FUNCTION (OR Disk_InitGeometry) MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ *
+ */
+int Disk_Init()
+{
+    return Disk_InitGeometry(SECTOR_SIZE, NUM_SECTORS);
+}
+
+/*
+ * Disk_InitGeometry
+ *
+ * Initializes the disk area for "count" sectors of "size" bytes each.
+ * The sector size has to be a power of two from SECTOR_SIZE up to
+ * MAX_SECTOR_SIZE.
+ */
+int Disk_InitGeometry(int size, int count)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // quick error checks
+    if ((size < SECTOR_SIZE) || (size > MAX_SECTOR_SIZE) || ((size & (size - 1)) != 0) || (count <= 0)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // throw away whatever disk we had before
+    Disk_Release();
+    free(dirtyBits);
+    free(verifiedBits);
+    free(sectorEpoch);
+    sectorSize = size;
+    numSectors = count;
+
+    // create the disk image and fill every sector with zeroes
+    dirtyWords = ((size_t) numSectors + 63) / 64;
+    dirtyBits = (unsigned long long *) calloc(dirtyWords, sizeof(unsigned long long));
+    verifiedBits = (unsigned long long *) calloc(dirtyWords, sizeof(unsigned long long));
+    sectorSums = (unsigned int *) calloc(numSectors, sizeof(unsigned int));
+    sectorEpoch = (unsigned int *) calloc(numSectors, sizeof(unsigned int));
+#ifdef WIN32
+    disk = (char *) calloc(numSectors, sectorSize);
+#else
+    // an anonymous mapping is zero filled (lazily) and page aligned
+    void* arena = mmap(NULL, Disk_Bytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (arena != MAP_FAILED) {
+        disk = (char *) arena;
+        arenaSize = Disk_Bytes();
+    }
+#endif
+    if(disk == NULL || dirtyBits == NULL || verifiedBits == NULL || sectorSums == NULL || sectorEpoch == NULL) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    Disk_FillZeroSums();
+    return 0;
+}
+
+/*
+ * Disk_SectorSize / Disk_NumSectors
+ *
+ * The geometry the disk was initialized with.
+ */
+int Disk_SectorSize()
+{
+    return sectorSize;
+}
+
+int Disk_NumSectors()
+{
+    return numSectors;
+}
+
+/*
+ * Disk_Resize
+ *
+ * Grows a per-sector array from "from" to "to" entries, zeroing the new
+ * ones. On failure the old array is left as it was.
+ */
+template<typename T>
+static bool Disk_Resize(T*& array, size_t from, size_t to)
+{
+    T* grown = (T*) realloc(array, to * sizeof(T));
+    if (grown == NULL) {
+        return false;
+    }
+    memset(grown + from, 0, (to - from) * sizeof(T));
+    array = grown;
+    return true;
+}
+
+#ifndef WIN32
+/*
+ * Disk_Remap
+ *
+ * Grows a mapping of the disk area to "newSize" bytes, moving it if it
+ * has to; the pages already there go along without being copied. "fd" is
+ * the file behind a shared mapping, or -1 for an anonymous one.
+ */
+static char* Disk_Remap(char* addr, size_t oldSize, size_t newSize, int fd)
+{
+#ifdef MREMAP_MAYMOVE
+    (void) fd; // the mapping already knows its file
+    void* moved = mremap(addr, oldSize, newSize, MREMAP_MAYMOVE);
+    return (moved == MAP_FAILED) ? NULL : (char*) moved;
+#else
+    int flags = (fd == -1) ? (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE) : MAP_SHARED;
+    void* moved = mmap(NULL, newSize, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (moved == MAP_FAILED) {
+        return NULL;
+    }
+    if (fd == -1) {
+        memcpy(moved, addr, oldSize);
+    }
+    munmap(addr, oldSize);
+    return (char*) moved;
+#endif
+}
+
+/*
+ * Disk_ExtendImage
+ *
+ * Makes an image file "oldBytes" of sectors long (plus its trailer) the
+ * size of the current disk: the old trailer is cut off so the new sectors
+ * read as zeroes (a hole, mostly), and the current checksums are written
+ * after them.
+ */
+static int Disk_ExtendImage(int fd, size_t oldBytes)
+{
+    Sum_Footer footer;
+    memcpy(footer.magic, SUM_MAGIC, 4);
+    footer.numSectors = numSectors;
+    if (ftruncate(fd, (off_t) oldBytes) == -1 || ftruncate(fd, (off_t)(Disk_Bytes() + Disk_SumBytes())) == -1 ||
+        Disk_PWriteAll(fd, (char*) sectorSums, (size_t) numSectors * sizeof(unsigned int), (off_t) Disk_Bytes()) == -1 ||
+        Disk_PWriteAll(fd, (char*) &footer, sizeof(Sum_Footer), (off_t)(Disk_Bytes() + Disk_SumBytes() - sizeof(Sum_Footer))) == -1) {
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Disk_Grow
+ *
+ * Adds sectors, all zeroes, to the end of the disk without moving or
+ * copying what's already on it. The disk's image file (the mapped or paged
+ * one, or the one it was last saved to or loaded from) grows to match, with
+ * its checksum trailer moved to the new end, so it's still a whole image
+ * and incremental saves keep working. Not allowed while there are
+ * checkpoints, which only know the old sectors.
+ */
+int Disk_Grow(int count)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // quick error checks
+    if (count < numSectors || !checkpoints.empty()) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (count == numSectors) {
+        return 0;
+    }
+
+    int oldSectors = numSectors;
+    size_t oldBytes = Disk_Bytes();
+    size_t newBytes = (size_t) count * sectorSize;
+    size_t words = ((size_t) count + 63) / 64;
+
+    // the bookkeeping first; if any of it fails the disk is still the old size
+    if (!Disk_Resize(dirtyBits, dirtyWords, words) || !Disk_Resize(verifiedBits, dirtyWords, words) ||
+        !Disk_Resize(sectorEpoch, (size_t) oldSectors, (size_t) count) ||
+        (mappedFd == -1 && !Disk_Resize(sectorSums, (size_t) oldSectors, (size_t) count))) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+
+#ifdef WIN32
+    char* grown = (char *) realloc(disk, newBytes);
+    if (grown == NULL) {
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    memset(grown + oldBytes, 0, newBytes - oldBytes);
+    disk = grown;
+    numSectors = count;
+    dirtyWords = words;
+#else
+    if (mappedFd != -1) {
+        // the trailer is in the mapping, where the new sectors go
+        std::vector<unsigned int> sums(sectorSums, sectorSums + oldSectors);
+        size_t size = newBytes + (size_t) count * sizeof(unsigned int) + sizeof(Sum_Footer);
+        if (ftruncate(mappedFd, (off_t) oldBytes) == -1 || ftruncate(mappedFd, (off_t) size) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        char* grown = Disk_Remap(disk, mappedSize, size, mappedFd);
+        if (grown == NULL) {
+            diskErrno = E_MAPPING_FILE;
+            return -1;
+        }
+        disk = grown;
+        mappedSize = size;
+        numSectors = count;
+        dirtyWords = words;
+        sectorSums = (unsigned int*)(disk + Disk_Bytes());
+        memcpy(sectorSums, sums.data(), (size_t) oldSectors * sizeof(unsigned int));
+        Sum_Footer* footer = (Sum_Footer*)(sectorSums + numSectors);
+        memcpy(footer->magic, SUM_MAGIC, 4);
+        footer->numSectors = numSectors;
+    } else {
+        // the paged disk's reserved space is whole blocks
+        size_t reserved = newBytes;
+        if (pagedFd != -1) {
+            reserved = (newBytes + pagedBlockBytes - 1) / pagedBlockBytes * pagedBlockBytes;
+        }
+        char* grown = (reserved == arenaSize) ? disk : Disk_Remap(disk, arenaSize, reserved, -1);
+        if (grown == NULL) {
+            diskErrno = E_MEM_OP;
+            return -1;
+        }
+        disk = grown;
+        arenaSize = reserved;
+        numSectors = count;
+        dirtyWords = words;
+        if (pagedFd != -1) {
+            std::lock_guard<std::mutex> guard(pagedLock);
+            blockFrame.resize(reserved / pagedBlockBytes, -1);
+        }
+    }
+#endif
+
+    // the new sectors are zeroes, and so are they in the file
+    std::vector<char> zero(sectorSize, 0);
+    unsigned int zeroSum = Disk_Crc32c(zero.data(), sectorSize);
+    for (int i = oldSectors; i < numSectors; i++) {
+        sectorSums[i] = zeroSum;
+        verifiedBits[i / 64] |= 1ULL << (i % 64);
+    }
+
+#ifndef WIN32
+    if (pagedFd != -1) {
+        if (Disk_ExtendImage(pagedFd, oldBytes) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+    } else if (mappedFd == -1 && syncedPath != NULL) {
+        // only worth it for a whole image; anything else gets a full save next time anyway
+        int fd = open(syncedPath, O_WRONLY);
+        struct stat st;
+        bool whole = (fd != -1 && fstat(fd, &st) == 0 &&
+                      (size_t) st.st_size == oldBytes + (size_t) oldSectors * sizeof(unsigned int) + sizeof(Sum_Footer));
+        if (!whole || Disk_ExtendImage(fd, oldBytes) == -1) {
+            Disk_SetSynced(NULL);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Disk_Map
+ *
+ * Replaces the disk area with a shared mapping of the given image file,
+ * creating or extending the file if it is too small. Nothing is read up
+ * front; sectors are paged in as they are touched and Disk_Save on the
+ * same file only has to msync what was written.
+ */
+int Disk_Map(char* file, int flags)
+{
+#ifdef WIN32
+    diskErrno = E_MAPPING_FILE;
+    return -1;
+#else
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    size_t size = Disk_Bytes() + Disk_SumBytes();
+    struct stat st;
+    int fd;
+    int mapFlags = MAP_SHARED;
+    void* addr;
+
+    // error check
+    if (file == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // open the image, making sure it is big enough to hold every sector and the checksums
+    if ((fd = open(file, O_RDWR | O_CREAT, 0644)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, size) == -1)) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+#ifdef MAP_POPULATE
+    if (flags & DISK_MAP_POPULATE) {
+        mapFlags |= MAP_POPULATE;
+    }
+#endif
+    if ((addr = mmap(NULL, size, PROT_READ | PROT_WRITE, mapFlags, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        diskErrno = E_MAPPING_FILE;
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (flags & DISK_MAP_HUGEPAGE) {
+        madvise(addr, size, MADV_HUGEPAGE); // only advice, fine if it is ignored
+    }
+#endif
+
+    // swap the mapping in for the old disk area
+    Disk_Release();
+    disk = (char*) addr;
+    mappedFd = fd;
+    mappedPath = strdup(file);
+    mappedSize = size;
+    Disk_SetSynced(file);
+
+    // the checksums live in the mapped trailer; an image that didn't have
+    // one yet gets it filled in now
+    sectorSums = (unsigned int*)(disk + Disk_Bytes());
+    Sum_Footer* footer = (Sum_Footer*)(sectorSums + numSectors);
+    memset(verifiedBits, 0, dirtyWords * sizeof(unsigned long long));
+    if ((size_t) st.st_size < size || !Disk_FooterMatches(footer)) {
+        if (st.st_size == 0) {
+            Disk_FillZeroSums();
+        } else {
+            Disk_ComputeAllSums();
+        }
+        memcpy(footer->magic, SUM_MAGIC, 4);
+        footer->numSectors = numSectors;
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Disk_OpenPaged
+ *
+ * Makes the given image file the disk, creating or extending it if it is
+ * too small, without reading it: sectors are paged in as they are touched,
+ * and no more than "memoryLimit" bytes of them are kept in memory. Blocks
+ * dropped to make room are written back first if they were changed, and
+ * Disk_Save on the same file just writes back what's left.
+ */
+int Disk_OpenPaged(char* file, size_t memoryLimit)
+{
+#ifdef WIN32
+    diskErrno = E_MAPPING_FILE;
+    return -1;
+#else
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    size_t size = Disk_Bytes() + Disk_SumBytes();
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t blockBytes = ((size_t) sectorSize > page) ? (size_t) sectorSize : page;
+    size_t reserved = (Disk_Bytes() + blockBytes - 1) / blockBytes * blockBytes;
+    struct stat st;
+    int fd;
+
+    // error check
+    if (file == NULL || memoryLimit < blockBytes) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // open the image, making sure it is big enough to hold every sector and the checksums
+    if ((fd = open(file, O_RDWR | O_CREAT, 0644)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || ((size_t)st.st_size < size && ftruncate(fd, size) == -1)) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    // the checksums are all that's kept for every sector
+    unsigned int* sums = (unsigned int *) malloc((size_t) numSectors * sizeof(unsigned int));
+    void* addr = mmap(NULL, reserved, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (sums == NULL || addr == MAP_FAILED) {
+        free(sums);
+        if (addr != MAP_FAILED) {
+            munmap(addr, reserved);
+        }
+        close(fd);
+        diskErrno = E_MEM_OP;
+        return -1;
+    }
+    if (Disk_PagedLoadSums(fd, (size_t) st.st_size, sums) == -1) {
+        free(sums);
+        munmap(addr, reserved);
+        close(fd);
+        return -1;
+    }
+
+    // swap the reserved space in for the old disk area
+    Disk_Release();
+    disk = (char*) addr;
+    arenaSize = reserved;
+    sectorSums = sums;
+    memset(verifiedBits, 0, dirtyWords * sizeof(unsigned long long));
+    pagedFd = fd;
+    pagedDirectFd = Disk_OpenDirect(file, O_RDWR);
+    pagedPath = strdup(file);
+    pagedBlockBytes = blockBytes;
+    pagedLimit = memoryLimit / blockBytes;
+    blockFrame.assign(reserved / blockBytes, -1);
+    Disk_PagedDropAll();
+    Disk_SetSynced(file);
+    return 0;
+#endif
+}
+
+/*
+ * Disk_Save
+ *
+ * Makes sure the current disk image gets saved to memory - this
+ * will overwrite an existing file with the same name so be careful
+ */
+int Disk_Save(char* file) {
+#ifdef WIN32
+    FILE* diskFile;
+#endif
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+    
+    // error check
+    if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+    }
+
+#ifndef WIN32
+    // saving a mapped disk back to its own file is just a sync of what changed
+    if (mappedPath != NULL && strcmp(file, mappedPath) == 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        int start, count, next = 0;
+        while ((count = Disk_NextDirtyRun(next, &start)) > 0) {
+            size_t from = ((size_t) start * sectorSize) / page * page;
+            size_t to = (size_t)(start + count) * sectorSize;
+            if (msync(disk + from, to - from, MS_SYNC) == -1) {
+                diskErrno = E_WRITING_FILE;
+                return -1;
+            }
+            next = start + count;
+        }
+
+        // and the checksum trailer (only its dirty pages actually get written)
+        size_t sums = Disk_Bytes() / page * page;
+        if (msync(disk + sums, mappedSize - sums, MS_SYNC) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        Disk_SetSynced(file);
+        return 0;
+    }
+
+    // a paged disk's own file just needs what was changed and is still resident
+    if (pagedPath != NULL && strcmp(file, pagedPath) == 0) {
+        if (Disk_PagedFlush(0, numSectors) == -1 || fsync(pagedFd) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        Disk_SetSynced(file);
+        return 0;
+    }
+
+    // and after that, its file is all there is to copy anywhere else
+    if (pagedPath != NULL) {
+        int fd;
+        if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+            diskErrno = E_OPENING_FILE;
+            return -1;
+        }
+        if (Disk_PagedFlush(0, numSectors) == -1 || Disk_CopyImage(pagedFd, fd, Disk_Bytes() + Disk_SumBytes()) == -1) {
+            close(fd);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        close(fd);
+        Disk_SetSynced(file);
+        return 0;
+    }
+#endif
+    
+#ifdef WIN32
+    // open the diskFile
+    if ((diskFile = fopen(file, "w")) == NULL) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+    }
+    
+    // actually write the disk image to a file
+    if ((fwrite(disk, sectorSize, numSectors, diskFile)) != (size_t) numSectors) {
+    fclose(diskFile);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+    }
+
+    // followed by the checksums
+    Sum_Footer footer;
+    memcpy(footer.magic, SUM_MAGIC, 4);
+    footer.numSectors = numSectors;
+    if (fwrite(sectorSums, sizeof(unsigned int), numSectors, diskFile) != (size_t) numSectors ||
+        fwrite(&footer, sizeof(Sum_Footer), 1, diskFile) != 1) {
+    fclose(diskFile);
+    diskErrno = E_WRITING_FILE;
+    return -1;
+    }
+    
+    // clean up and return
+    fclose(diskFile);
+#else
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<long long> moved(0);
+    int fd, directFd;
+
+    // open the diskFile
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    directFd = Disk_OpenDirect(file, O_WRONLY);
+
+    // write each run of non-zero sectors, a chunk per thread at a time;
+    // all-zero ones are left as holes
+    int written = Disk_RunChunks([&](int first, int count) -> int {
+        int sector = first;
+        while (sector < first + count) {
+            if (Disk_SectorIsZero(sector)) {
+                sector++;
+                continue;
+            }
+            int run = sector;
+            while (sector < first + count && !Disk_SectorIsZero(sector)) {
+                sector++;
+            }
+            if (Disk_TransferSpan(fd, directFd, (size_t) run * sectorSize, (size_t) sector * sectorSize, true) == -1) {
+                return -1;
+            }
+            moved += (long long)(sector - run) * sectorSize;
+        }
+        return 0;
+    });
+    if (directFd != -1) {
+        close(directFd);
+    }
+    if (written == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    // the checksum trailer goes after the last sector, and a trailing hole
+    // before it still counts towards the file size
+    Sum_Footer footer;
+    memcpy(footer.magic, SUM_MAGIC, 4);
+    footer.numSectors = numSectors;
+    if (Disk_PWriteAll(fd, (char*) sectorSums, (size_t) numSectors * sizeof(unsigned int), (off_t) Disk_Bytes()) == -1 ||
+        Disk_PWriteAll(fd, (char*) &footer, sizeof(Sum_Footer), (off_t)(Disk_Bytes() + Disk_SumBytes() - sizeof(Sum_Footer))) == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    // clean up and return
+    close(fd);
+    Disk_RecordTransfer(moved + (long long) Disk_SumBytes(), start);
+#endif
+    Disk_SetSynced(file);
+    return 0;
+}
+
+/*
+ * Disk_SaveIncremental
+ *
+ * Like Disk_Save, but if the disk was last saved to or loaded from this
+ * same file only the sectors written since then are rewritten (in runs
+ * of consecutive sectors) and the file is fsync'd. Anything else falls
+ * back to a full Disk_Save.
+ */
+int Disk_SaveIncremental(char* file) {
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // error check
+    if (file == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+#ifdef WIN32
+    return Disk_Save(file);
+#else
+    int fd;
+    struct stat st;
+    int start, count, next = 0;
+
+    // a mapped or paged disk, or one that doesn't match this file, is handled by Disk_Save
+    if (mappedPath != NULL || pagedPath != NULL || syncedPath == NULL || strcmp(file, syncedPath) != 0) {
+        return Disk_Save(file);
+    }
+
+    // the file has to still be a whole image for patching it to make sense
+    if ((fd = open(file, O_WRONLY)) == -1) {
+        return Disk_Save(file);
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != Disk_Bytes() + Disk_SumBytes()) {
+        close(fd);
+        return Disk_Save(file);
+    }
+
+    // write out each dirty run in one go, along with its checksums
+    int directFd = Disk_OpenDirect(file, O_WRONLY);
+    while ((count = Disk_NextDirtyRun(next, &start)) > 0) {
+        if (Disk_TransferSpan(fd, directFd, (size_t) start * sectorSize, (size_t)(start + count) * sectorSize, true) == -1 ||
+            Disk_PWriteAll(fd, (char*)(sectorSums + start), (size_t) count * sizeof(unsigned int),
+                           (off_t)(Disk_Bytes() + (size_t) start * sizeof(unsigned int))) == -1) {
+            close(fd);
+            if (directFd != -1) {
+                close(directFd);
+            }
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        next = start + count;
+    }
+    if (directFd != -1) {
+        close(directFd);
+    }
+
+    if (fsync(fd) == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    close(fd);
+    Disk_SetSynced(file);
+    return 0;
+#endif
+}
+
+/*
+ * Disk_SaveRange
+ *
+ * Writes just "count" sectors starting at "sector" to the file the disk
+ * was last saved to or loaded from, and makes them durable, without
+ * touching anything else in it. Other dirty sectors stay dirty. A disk
+ * that doesn't match the file gets a full Disk_Save instead.
+ */
+int Disk_SaveRange(char* file, int sector, int count)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // error check
+    if (file == NULL || (sector < 0) || (count < 0) || (count > numSectors - sector)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+#ifdef WIN32
+    return Disk_Save(file);
+#else
+    int fd;
+    struct stat st;
+
+    // a mapped disk only has to push those pages (and their checksums) out
+    if (mappedPath != NULL && strcmp(file, mappedPath) == 0) {
+        long page = sysconf(_SC_PAGESIZE);
+        size_t from = ((size_t) sector * sectorSize) / page * page;
+        size_t to = (size_t)(sector + count) * sectorSize;
+        size_t sumsFrom = (Disk_Bytes() + (size_t) sector * sizeof(unsigned int)) / page * page;
+        size_t sumsTo = Disk_Bytes() + (size_t)(sector + count) * sizeof(unsigned int);
+        if (msync(disk + from, to - from, MS_SYNC) == -1 ||
+            msync(disk + sumsFrom, sumsTo - sumsFrom, MS_SYNC) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        Disk_ClearDirty(sector, count);
+        return 0;
+    }
+
+    // a paged one, the resident blocks holding them
+    if (pagedPath != NULL && strcmp(file, pagedPath) == 0) {
+        if (Disk_PagedFlush(sector, count) == -1 || fsync(pagedFd) == -1) {
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        Disk_ClearDirty(sector, count);
+        return 0;
+    }
+
+    // anything that doesn't match this file is handled by Disk_Save
+    if (mappedPath != NULL || pagedPath != NULL || syncedPath == NULL || strcmp(file, syncedPath) != 0) {
+        return Disk_Save(file);
+    }
+    if ((fd = open(file, O_WRONLY)) == -1) {
+        return Disk_Save(file);
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size != Disk_Bytes() + Disk_SumBytes()) {
+        close(fd);
+        return Disk_Save(file);
+    }
+
+    // one write for the sectors, one for their checksums, then make it stick
+    int directFd = Disk_OpenDirect(file, O_WRONLY);
+    int written = Disk_TransferSpan(fd, directFd, (size_t) sector * sectorSize, (size_t)(sector + count) * sectorSize, true);
+    if (directFd != -1) {
+        close(directFd);
+    }
+    if (written == -1 ||
+        Disk_PWriteAll(fd, (char*)(sectorSums + sector), (size_t) count * sizeof(unsigned int),
+                       (off_t)(Disk_Bytes() + (size_t) sector * sizeof(unsigned int))) == -1 ||
+        fsync(fd) == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    close(fd);
+    Disk_ClearDirty(sector, count);
+    return 0;
+#endif
+}
+
+/*
+ * Disk_Load
+ *
+ * Loads a current disk image from disk into memory - requires that
+ * the disk be created first.
+ */
+int Disk_Load(char* file) {
+#ifdef WIN32
+    FILE* diskFile;
+#endif
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+    
+    // error check
+    if (file == NULL) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+    }
+
+    // a mapped disk already *is* the contents of its own file
+    if ((mappedPath != NULL && strcmp(file, mappedPath) == 0) ||
+        (pagedPath != NULL && strcmp(file, pagedPath) == 0)) {
+        return 0;
+    }
+
+#ifndef WIN32
+    // a paged disk has its file overwritten with the image, and pages that in
+    if (pagedPath != NULL) {
+        int fd;
+        struct stat st;
+        if ((fd = open(file, O_RDONLY)) == -1) {
+            diskErrno = E_OPENING_FILE;
+            return -1;
+        }
+        if (fstat(fd, &st) == -1 || (size_t) st.st_size < Disk_Bytes()) {
+            close(fd);
+            diskErrno = E_READING_FILE;
+            return -1;
+        }
+        size_t size = Disk_Bytes() + Disk_SumBytes();
+        Disk_PagedDropAll();
+        if (Disk_CopyImage(fd, pagedFd, ((size_t) st.st_size < size) ? (size_t) st.st_size : size) == -1) {
+            close(fd);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        close(fd);
+        if (Disk_PagedLoadSums(pagedFd, size, sectorSums) == -1) {
+            return -1;
+        }
+        memset(verifiedBits, 0, dirtyWords * sizeof(unsigned long long));
+        Disk_SetSynced(file);
+        return 0;
+    }
+#endif
+
+    // loading rewrites every sector, so checkpoints need them all
+    for (int i = 0; i < numSectors; i++) {
+        Disk_Preserve(i);
+    }
+    
+#ifdef WIN32
+    // open the diskFile
+    if ((diskFile = fopen(file, "r")) == NULL) {
+    diskErrno = E_OPENING_FILE;
+    return -1;
+    }
+    
+    // actually read the disk image into memory
+    if ((fread(disk, sectorSize, numSectors, diskFile)) != (size_t) numSectors) {
+    fclose(diskFile);
+    diskErrno = E_READING_FILE;
+    return -1;
+    }
+
+    // use the checksums if the image has them, otherwise start from what's there
+    Sum_Footer footer;
+    memset(verifiedBits, 0, dirtyWords * sizeof(unsigned long long));
+    if (fread(sectorSums, sizeof(unsigned int), numSectors, diskFile) != (size_t) numSectors ||
+        fread(&footer, sizeof(Sum_Footer), 1, diskFile) != 1 || !Disk_FooterMatches(&footer)) {
+        Disk_ComputeAllSums();
+    }
+
+    // clean up and return
+    fclose(diskFile);
+#else
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::atomic<long long> moved(0);
+    int fd;
+    struct stat st;
+    off_t size = (off_t) Disk_Bytes();
+
+    // open the diskFile
+    if ((fd = open(file, O_RDONLY)) == -1) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < size) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+    int directFd = Disk_OpenDirect(file, O_RDONLY);
+
+    // use the checksums if the image has them, otherwise they're worked
+    // out from the sectors as they come in
+    Sum_Footer footer;
+    bool haveSums = (size_t) st.st_size >= Disk_Bytes() + Disk_SumBytes() &&
+        Disk_PReadAll(fd, (char*) sectorSums, (size_t) numSectors * sizeof(unsigned int), size) == 0 &&
+        Disk_PReadAll(fd, (char*) &footer, sizeof(Sum_Footer), (off_t)(Disk_Bytes() + Disk_SumBytes() - sizeof(Sum_Footer))) == 0 &&
+        Disk_FooterMatches(&footer);
+    memset(verifiedBits, 0, dirtyWords * sizeof(unsigned long long));
+
+    // a chunk per thread at a time, only reading the parts of the file
+    // that hold data; holes just become zeroes
+    int loaded = Disk_RunChunks([&](int first, int count) -> int {
+        off_t pos = (off_t) first * sectorSize;
+        off_t end = (off_t)(first + count) * sectorSize;
+        while (pos < end) {
+            off_t data = lseek(fd, pos, SEEK_DATA);
+            off_t hole;
+            if (data == -1) {
+                // ENXIO means nothing but hole from here on, anything else means
+                // the filesystem can't tell us, so read it all
+                data = (errno == ENXIO) ? end : pos;
+            }
+            if (data > end) {
+                data = end;
+            }
+            memset(disk + pos, 0, data - pos);
+            if (data == end) {
+                break;
+            }
+
+            if ((hole = lseek(fd, data, SEEK_HOLE)) == -1 || hole > end) {
+                hole = end;
+            }
+            if (Disk_TransferSpan(fd, directFd, (size_t) data, (size_t) hole, false) == -1) {
+                return -1;
+            }
+            moved += hole - data;
+            pos = hole;
+        }
+        if (!haveSums) {
+            for (int i = first; i < first + count; i++) {
+                Disk_UpdateSum(i);
+            }
+        }
+        return 0;
+    });
+    if (directFd != -1) {
+        close(directFd);
+    }
+    if (loaded == -1) {
+        close(fd);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    // clean up and return
+    close(fd);
+    Disk_RecordTransfer(moved + (haveSums ? (long long) Disk_SumBytes() : 0), start);
+#endif
+    Disk_SetSynced(file);
+
+    // a mapped disk now differs from its own file everywhere
+    if (mappedPath != NULL) {
+        memset(dirtyBits, 0xff, dirtyWords * sizeof(unsigned long long));
+    }
+    return 0;
+}
+
+/*
+ * Disk_LzPutLength
+ *
+ * Writes the extra bytes of a literal or match length that didn't fit in
+ * its 4 bits of the token. Returns the new output position or -1 if out
+ * of room.
+ */
+static int Disk_LzPutLength(unsigned char* out, int op, int outCap, int length)
+{
+    for (length -= 15; length >= 255; length -= 255) {
+        if (op >= outCap) {
+            return -1;
+        }
+        out[op++] = 255;
+    }
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char) length;
+    return op;
+}
+
+/*
+ * Disk_LzEmit
+ *
+ * Writes one sequence: a token, literals, and (if matchLength is not 0)
+ * a 2 byte back offset with the match length. Returns the new output
+ * position or -1 if out of room.
+ */
+static int Disk_LzEmit(const unsigned char* literals, int literalLength, int offset, int matchLength,
+                       unsigned char* out, int op, int outCap)
+{
+    int matchCode = matchLength ? matchLength - LZ_MIN_MATCH : 0;
+
+    if (op >= outCap) {
+        return -1;
+    }
+    out[op++] = (unsigned char)(((literalLength < 15 ? literalLength : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+    if (literalLength >= 15 && (op = Disk_LzPutLength(out, op, outCap, literalLength)) == -1) {
+        return -1;
+    }
+    if (op + literalLength > outCap) {
+        return -1;
+    }
+    memcpy(out + op, literals, literalLength);
+    op += literalLength;
+
+    if (matchLength) {
+        if (op + 2 > outCap) {
+            return -1;
+        }
+        out[op++] = (unsigned char)(offset & 0xff);
+        out[op++] = (unsigned char)(offset >> 8);
+        if (matchCode >= 15 && (op = Disk_LzPutLength(out, op, outCap, matchCode)) == -1) {
+            return -1;
+        }
+    }
+    return op;
+}
+
+/*
+ * Disk_LzCompress
+ *
+ * A small LZ77 in the style of LZ4: a hash table of recent 4 byte
+ * sequences finds matches up to 64K back. Returns the compressed size, or
+ * -1 if it won't fit in outCap bytes.
+ */
+static int Disk_LzCompress(const unsigned char* in, int inLength, unsigned char* out, int outCap)
+{
+    std::vector<int> table(1 << LZ_HASH_BITS, -1);
+    int ip = 0;
+    int anchor = 0;
+    int op = 0;
+
+    while (ip + LZ_MIN_MATCH <= inLength) {
+        unsigned int sequence;
+        memcpy(&sequence, in + ip, sizeof(sequence));
+        unsigned int hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        int ref = table[hash];
+        table[hash] = ip;
+
+        if (ref < 0 || ip - ref > LZ_MAX_OFFSET || memcmp(in + ref, in + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        int matchLength = LZ_MIN_MATCH;
+        while (ip + matchLength < inLength && in[ref + matchLength] == in[ip + matchLength]) {
+            matchLength++;
+        }
+        if ((op = Disk_LzEmit(in + anchor, ip - anchor, ip - ref, matchLength, out, op, outCap)) == -1) {
+            return -1;
+        }
+        ip += matchLength;
+        anchor = ip;
+    }
+
+    // whatever is left goes out as literals
+    return Disk_LzEmit(in + anchor, inLength - anchor, 0, 0, out, op, outCap);
+}
+
+/*
+ * Disk_LzGetLength
+ *
+ * Reads the extra bytes of a length. Returns -1 on running off the input.
+ */
+static int Disk_LzGetLength(const unsigned char* in, int* ip, int inLength, int length)
+{
+    unsigned char byte;
+    do {
+        if (*ip >= inLength) {
+            return -1;
+        }
+        byte = in[(*ip)++];
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+/*
+ * Disk_LzDecompress
+ *
+ * Undoes Disk_LzCompress. Returns the decompressed size, or -1 if the
+ * input is corrupt or would overflow outLength bytes.
+ */
+static int Disk_LzDecompress(const unsigned char* in, int inLength, unsigned char* out, int outLength)
+{
+    int ip = 0;
+    int op = 0;
+
+    while (ip < inLength) {
+        int token = in[ip++];
+        int literalLength = token >> 4;
+        if (literalLength == 15 && (literalLength = Disk_LzGetLength(in, &ip, inLength, 15)) == -1) {
+            return -1;
+        }
+        if (ip + literalLength > inLength || op + literalLength > outLength) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, literalLength);
+        ip += literalLength;
+        op += literalLength;
+
+        if (ip == inLength) {
+            break; // the last sequence has no match
+        }
+
+        if (ip + 2 > inLength) {
+            return -1;
+        }
+        int offset = in[ip] | (in[ip + 1] << 8);
+        ip += 2;
+        int matchLength = token & 15;
+        if (matchLength == 15 && (matchLength = Disk_LzGetLength(in, &ip, inLength, 15)) == -1) {
+            return -1;
+        }
+        matchLength += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || op + matchLength > outLength) {
+            return -1;
+        }
+        // byte by byte, since the match may overlap what it is producing
+        for (int i = 0; i < matchLength; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return op;
+}
+
+/*
+ * Disk_ReadLzHeader
+ *
+ * Reads and checks the header of a compressed image.
+ */
+static int Disk_ReadLzHeader(FILE* diskFile, LZ_Header* header)
+{
+    if (fread(header, sizeof(LZ_Header), 1, diskFile) != 1 || memcmp(header->magic, LZ_MAGIC, 4) != 0 ||
+        header->sectorSize <= 0 || header->sectorSize > MAX_SECTOR_SIZE || header->numSectors <= 0 ||
+        header->groupSectors <= 0 ||
+        header->numGroups != (header->numSectors + header->groupSectors - 1) / header->groupSectors) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Disk_ReadLzGroup
+ *
+ * Reads the group described by "entry" and expands it into "to", which
+ * must hold "length" bytes.
+ */
+static int Disk_ReadLzGroup(FILE* diskFile, LZ_Group* entry, char* to, int length)
+{
+    if (entry->length == 0) {
+        memset(to, 0, length);
+        return 0;
+    }
+    if (entry->length < 0 || entry->length > length || fseek(diskFile, (long) entry->offset, SEEK_SET) != 0) {
+        return -1;
+    }
+
+    if (entry->stored) {
+        return (entry->length == length && fread(to, 1, length, diskFile) == (size_t) length) ? 0 : -1;
+    }
+    std::vector<unsigned char> packed(entry->length);
+    if (fread(packed.data(), 1, entry->length, diskFile) != (size_t) entry->length) {
+        return -1;
+    }
+    return (Disk_LzDecompress(packed.data(), entry->length, (unsigned char*) to, length) == length) ? 0 : -1;
+}
+
+/*
+ * Disk_SaveCompressed
+ *
+ * Saves the disk as a compressed image. Sectors are compressed in groups
+ * of LZ_GROUP_SECTORS; a group that is all zeroes takes no space at all,
+ * and one that doesn't shrink is stored as is.
+ */
+int Disk_SaveCompressed(char* file)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    FILE* diskFile;
+    LZ_Header header;
+    int groupBytes = LZ_GROUP_SECTORS * sectorSize;
+
+    // error check (a paged disk isn't all in memory to compress)
+    if (file == NULL || pagedFd != -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // open the diskFile
+    if ((diskFile = fopen(file, "wb")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    memcpy(header.magic, LZ_MAGIC, 4);
+    header.sectorSize = sectorSize;
+    header.numSectors = numSectors;
+    header.groupSectors = LZ_GROUP_SECTORS;
+    header.numGroups = (numSectors + LZ_GROUP_SECTORS - 1) / LZ_GROUP_SECTORS;
+
+    // groups go right after the header and index
+    std::vector<LZ_Group> index(header.numGroups);
+    std::vector<unsigned char> packed(groupBytes);
+    long long offset = sizeof(LZ_Header) + (long long) header.numGroups * sizeof(LZ_Group);
+    if (fseek(diskFile, (long) offset, SEEK_SET) != 0) {
+        fclose(diskFile);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    for (int g = 0; g < header.numGroups; g++) {
+        int first = g * LZ_GROUP_SECTORS;
+        int count = (numSectors - first < LZ_GROUP_SECTORS) ? numSectors - first : LZ_GROUP_SECTORS;
+        int length = count * sectorSize;
+        bool zero = true;
+        for (int i = first; zero && i < first + count; i++) {
+            zero = Disk_SectorIsZero(i);
+        }
+
+        index[g].offset = offset;
+        index[g].length = 0;
+        index[g].stored = 0;
+        if (zero) {
+            continue;
+        }
+
+        const unsigned char* raw = (const unsigned char*) Disk_Addr(first);
+        int packedLength = Disk_LzCompress(raw, length, packed.data(), length - 1);
+        if (packedLength == -1) {
+            index[g].length = length;
+            index[g].stored = 1;
+        } else {
+            index[g].length = packedLength;
+            raw = packed.data();
+        }
+        if (fwrite(raw, 1, index[g].length, diskFile) != (size_t) index[g].length) {
+            fclose(diskFile);
+            diskErrno = E_WRITING_FILE;
+            return -1;
+        }
+        offset += index[g].length;
+    }
+
+    // now the index is known, go back and put it up front
+    if (fseek(diskFile, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(LZ_Header), 1, diskFile) != 1 ||
+        fwrite(index.data(), sizeof(LZ_Group), header.numGroups, diskFile) != (size_t) header.numGroups) {
+        fclose(diskFile);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+
+    // clean up and return
+    if (fclose(diskFile) != 0) {
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Disk_LoadCompressed
+ *
+ * Loads a whole compressed image into the disk. The image has to have the
+ * same geometry as the disk.
+ */
+int Disk_LoadCompressed(char* file)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    FILE* diskFile;
+    LZ_Header header;
+
+    // error check (a paged disk isn't all in memory to compress)
+    if (file == NULL || pagedFd != -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // open the diskFile
+    if ((diskFile = fopen(file, "rb")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    if (Disk_ReadLzHeader(diskFile, &header) == -1) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+    if (header.sectorSize != sectorSize || header.numSectors != numSectors) {
+        fclose(diskFile);
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // loading rewrites every sector, so checkpoints need them all
+    for (int i = 0; i < numSectors; i++) {
+        Disk_Preserve(i);
+    }
+
+    std::vector<LZ_Group> index(header.numGroups);
+    if (fread(index.data(), sizeof(LZ_Group), header.numGroups, diskFile) != (size_t) header.numGroups) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    // expand every group straight into place
+    for (int g = 0; g < header.numGroups; g++) {
+        int first = g * header.groupSectors;
+        int count = (numSectors - first < header.groupSectors) ? numSectors - first : header.groupSectors;
+        if (Disk_ReadLzGroup(diskFile, &index[g], Disk_Addr(first), count * sectorSize) == -1) {
+            fclose(diskFile);
+            diskErrno = E_READING_FILE;
+            return -1;
+        }
+    }
+
+    // clean up and return; the disk matches no raw image now
+    fclose(diskFile);
+    Disk_ComputeAllSums();
+    Disk_SetSynced(NULL);
+    if (mappedPath != NULL) {
+        memset(dirtyBits, 0xff, dirtyWords * sizeof(unsigned long long));
+    }
+    return 0;
+}
+
+/*
+ * Disk_ReadCompressed
+ *
+ * Reads one sector out of a compressed image without loading the rest:
+ * just its index entry and its group are read and expanded. The buffer
+ * has to hold a whole sector of the image.
+ */
+int Disk_ReadCompressed(char* file, int sector, char* buffer)
+{
+    FILE* diskFile;
+    LZ_Header header;
+    LZ_Group entry;
+
+    // error check
+    if (file == NULL || buffer == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // open the diskFile
+    if ((diskFile = fopen(file, "rb")) == NULL) {
+        diskErrno = E_OPENING_FILE;
+        return -1;
+    }
+
+    if (Disk_ReadLzHeader(diskFile, &header) == -1) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+    if (sector < 0 || sector >= header.numSectors) {
+        fclose(diskFile);
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // find the group's entry in the index
+    int g = sector / header.groupSectors;
+    if (fseek(diskFile, (long)(sizeof(LZ_Header) + (long long) g * sizeof(LZ_Group)), SEEK_SET) != 0 ||
+        fread(&entry, sizeof(LZ_Group), 1, diskFile) != 1) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    int first = g * header.groupSectors;
+    int count = (header.numSectors - first < header.groupSectors) ? header.numSectors - first : header.groupSectors;
+    std::vector<char> group((size_t) count * header.sectorSize);
+    if (Disk_ReadLzGroup(diskFile, &entry, group.data(), (int) group.size()) == -1) {
+        fclose(diskFile);
+        diskErrno = E_READING_FILE;
+        return -1;
+    }
+
+    memcpy(buffer, group.data() + (size_t)(sector - first) * header.sectorSize, header.sectorSize);
+    fclose(diskFile);
+    return 0;
+}
+
+#ifndef WIN32
+/*
+ * Disk_StripeFileBytes
+ *
+ * How much of stripe file "index" is sector data (the trailer goes after).
+ */
+static size_t Disk_StripeFileBytes(int index, int numFiles, int stripeSectors)
+{
+    int units = (numSectors + stripeSectors - 1) / stripeSectors;
+    int mine = (units - index + numFiles - 1) / numFiles;
+    return (size_t) mine * stripeSectors * sectorSize;
+}
+
+/*
+ * Disk_SaveStripe
+ *
+ * Body of each Disk_SaveStriped worker: writes every unit that belongs
+ * to file "index" (skipping all-zero ones, they read back as holes),
+ * then the trailer, then fsyncs.
+ */
+static void Disk_SaveStripe(char* file, int index, int numFiles, int stripeSectors, Disk_Error_t* error)
+{
+    int fd;
+    if ((fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) {
+        *error = E_OPENING_FILE;
+        return;
+    }
+
+    for (int first = index * stripeSectors; first < numSectors; first += numFiles * stripeSectors) {
+        int count = (numSectors - first < stripeSectors) ? numSectors - first : stripeSectors;
+        bool zero = true;
+        for (int i = first; zero && i < first + count; i++) {
+            zero = Disk_SectorIsZero(i);
+        }
+        off_t offset = (off_t)(first / stripeSectors / numFiles) * stripeSectors * sectorSize;
+        if (!zero && Disk_PWriteAll(fd, Disk_Addr(first), (size_t) count * sectorSize, offset) == -1) {
+            close(fd);
+            *error = E_WRITING_FILE;
+            return;
+        }
+    }
+
+    Stripe_Trailer trailer;
+    memcpy(trailer.magic, STRIPE_MAGIC, 4);
+    trailer.sectorSize = sectorSize;
+    trailer.numSectors = numSectors;
+    trailer.stripeSectors = stripeSectors;
+    trailer.numFiles = numFiles;
+    trailer.index = index;
+    if (Disk_PWriteAll(fd, (char*) &trailer, sizeof(trailer), (off_t) Disk_StripeFileBytes(index, numFiles, stripeSectors)) == -1 ||
+        fsync(fd) == -1) {
+        close(fd);
+        *error = E_WRITING_FILE;
+        return;
+    }
+    close(fd);
+}
+
+/*
+ * Disk_LoadStripe
+ *
+ * Body of each Disk_LoadStriped worker: checks the trailer, then reads
+ * every unit that belongs to file "index" and checksums it.
+ */
+static void Disk_LoadStripe(char* file, int index, int numFiles, int stripeSectors, Disk_Error_t* error)
+{
+    int fd;
+    Stripe_Trailer trailer;
+    if ((fd = open(file, O_RDONLY)) == -1) {
+        *error = E_OPENING_FILE;
+        return;
+    }
+
+    // the file has to be this part of a disk like this one
+    if (Disk_PReadAll(fd, (char*) &trailer, sizeof(trailer), (off_t) Disk_StripeFileBytes(index, numFiles, stripeSectors)) == -1) {
+        close(fd);
+        *error = E_READING_FILE;
+        return;
+    }
+    if (memcmp(trailer.magic, STRIPE_MAGIC, 4) != 0 || trailer.sectorSize != sectorSize || trailer.numSectors != numSectors ||
+        trailer.stripeSectors != stripeSectors || trailer.numFiles != numFiles || trailer.index != index) {
+        close(fd);
+        *error = E_INVALID_PARAM;
+        return;
+    }
+
+    for (int first = index * stripeSectors; first < numSectors; first += numFiles * stripeSectors) {
+        int count = (numSectors - first < stripeSectors) ? numSectors - first : stripeSectors;
+        off_t offset = (off_t)(first / stripeSectors / numFiles) * stripeSectors * sectorSize;
+        if (Disk_PReadAll(fd, Disk_Addr(first), (size_t) count * sectorSize, offset) == -1) {
+            close(fd);
+            *error = E_READING_FILE;
+            return;
+        }
+
+        // only the sums here, the verified bits are shared with other stripes
+        for (int i = first; i < first + count; i++) {
+            sectorSums[i] = Disk_Crc32c(Disk_Addr(i), sectorSize);
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Disk_RunStripes
+ *
+ * Runs one worker per file and waits for them all. Returns -1 with the
+ * first worker's error if any of them failed.
+ */
+static int Disk_RunStripes(void (*worker)(char*, int, int, int, Disk_Error_t*), char** files, int numFiles, int stripeSectors)
+{
+    std::vector<Disk_Error_t> errors(numFiles, (Disk_Error_t) -1);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < numFiles; i++) {
+        workers.push_back(std::thread(worker, files[i], i, numFiles, stripeSectors, &errors[i]));
+    }
+    for (int i = 0; i < numFiles; i++) {
+        workers[i].join();
+    }
+    for (int i = 0; i < numFiles; i++) {
+        if (errors[i] != (Disk_Error_t) -1) {
+            diskErrno = errors[i];
+            return -1;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+ * Disk_SaveStriped
+ *
+ * Saves the disk spread over "numFiles" files, "stripeSectors" sectors at
+ * a time, with one thread per file so that files on different devices are
+ * written at the same time.
+ */
+int Disk_SaveStriped(char** files, int numFiles, int stripeSectors)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // error check (a paged disk isn't all in memory to stripe)
+    if (files == NULL || numFiles <= 0 || stripeSectors <= 0 || pagedFd != -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        if (files[i] == NULL) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+#ifdef WIN32
+    // needs pwrite
+    diskErrno = E_WRITING_FILE;
+    return -1;
+#else
+    if (Disk_RunStripes(Disk_SaveStripe, files, numFiles, stripeSectors) == -1) {
+        return -1;
+    }
+
+    // the disk matches no single image now
+    Disk_SetSynced(NULL);
+    return 0;
+#endif
+}
+
+/*
+ * Disk_LoadStriped
+ *
+ * Loads a disk saved with Disk_SaveStriped, given the same files in the
+ * same order and the same stripe size, one thread per file.
+ */
+int Disk_LoadStriped(char** files, int numFiles, int stripeSectors)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
+    // error check (a paged disk isn't all in memory to stripe)
+    if (files == NULL || numFiles <= 0 || stripeSectors <= 0 || pagedFd != -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (int i = 0; i < numFiles; i++) {
+        if (files[i] == NULL) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+#ifdef WIN32
+    // needs pread
+    diskErrno = E_READING_FILE;
+    return -1;
+#else
+    // loading rewrites every sector, so checkpoints need them all
+    for (int i = 0; i < numSectors; i++) {
+        Disk_Preserve(i);
+    }
+
+    if (Disk_RunStripes(Disk_LoadStripe, files, numFiles, stripeSectors) == -1) {
+        return -1;
+    }
+
+    // the workers did the sums, so everything's verified
+    memset(verifiedBits, 0xff, dirtyWords * sizeof(unsigned long long));
+    Disk_SetSynced(NULL);
+    if (mappedPath != NULL) {
+        memset(dirtyBits, 0xff, dirtyWords * sizeof(unsigned long long));
+    }
+    return 0;
+#endif
+}
+
+/*
+ * Disk_Read
+ *
+ * Reads a single sector from "disk" and puts it into a buffer provided
+ * by the user.
+ */
+int Disk_Read(int sector, char* buffer) {
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+    }
+    Disk_StripeGuard guard(Disk_SectorStripe(sector));
+    Disk_PageGuard pages(sector, 1, false);
+    if (pages.failed) {
+    return -1;
+    }
+
+    // make sure the sector hasn't gone bad since it was saved
+    if (Disk_CheckSum(sector) == -1) {
+    return -1;
+    }
+    
+    // copy the memory for the user
+    if((memcpy((void*)buffer, (void*)Disk_Addr(sector), sectorSize)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+    }
+    Disk_Account(sector, 1, false);
+    
+    return 0;
+}
+
+/*
+ * Disk_Write
+ *
+ * Writes a single sector from memory to "disk".
+ */
+int Disk_Write(int sector, char* buffer) 
+{
+    // quick error checks
+    if((sector < 0) || (sector >= numSectors) || (buffer == NULL)) {
+    diskErrno = E_INVALID_PARAM;
+    return -1;
+    }
+    Disk_StripeGuard guard(Disk_SectorStripe(sector));
+    Disk_PageGuard pages(sector, 1, true);
+    if (pages.failed) {
+    return -1;
+    }
+    Disk_Preserve(sector);
+    
+    // copy the memory for the user
+    if((memcpy((void*)Disk_Addr(sector), (void*)buffer, sectorSize)) == NULL) {
+    diskErrno = E_MEM_OP;
+    return -1;
+    }
+
+    // remember what needs saving
+    Disk_MarkDirty(sector);
+    Disk_UpdateSum(sector);
+    Disk_Account(sector, 1, true);
+    return 0;
+}
+
+/*
+ * Disk_ReadV
+ *
+ * Scatter read: fills each buffer in the vector from its sector. Every
+ * entry is validated up front, so a bad parameter copies nothing; a sector
+ * failing its checksum stops the read with the entries before it filled.
+ */
+int Disk_ReadV(Disk_IOVec* iov, int count)
+{
+    unsigned long long mask = 0;
+
+    // quick error checks, once for the whole batch
+    if ((iov == NULL && count > 0) || count < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if ((iov[i].sector < 0) || (iov[i].sector >= numSectors) || (iov[i].buffer == NULL)) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+        mask |= Disk_SectorStripe(iov[i].sector);
+    }
+    Disk_StripeGuard guard(mask);
+
+    // check and copy each sector for the user while it's paged in
+    for (int i = 0; i < count; i++) {
+        Disk_PageGuard pages(iov[i].sector, 1, false);
+        if (pages.failed || Disk_CheckSum(iov[i].sector) == -1) {
+            return -1;
+        }
+        memcpy(iov[i].buffer, Disk_Addr(iov[i].sector), sectorSize);
+        Disk_Account(iov[i].sector, 1, false);
+    }
+    return 0;
+}
+
+/*
+ * Disk_WriteV
+ *
+ * Gather write: copies each buffer in the vector to its sector. Every
+ * entry is validated up front, so on error nothing has been written.
+ */
+int Disk_WriteV(Disk_IOVec* iov, int count)
+{
+    unsigned long long mask = 0;
 
-// used to see what happened w/ disk ops
-Disk_Error_t diskErrno; 
+    // quick error checks, once for the whole batch
+    if ((iov == NULL && count > 0) || count < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        if ((iov[i].sector < 0) || (iov[i].sector >= numSectors) || (iov[i].buffer == NULL)) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+        mask |= Disk_SectorStripe(iov[i].sector);
+    }
+    Disk_StripeGuard guard(mask);
 
-// used for statistics
-// static int lastSector = 0;
-// static int seekCount = 0;
+    // copy the memory for the user and remember what needs saving
+    for (int i = 0; i < count; i++) {
+        Disk_PageGuard pages(iov[i].sector, 1, true);
+        if (pages.failed) {
+            return -1;
+        }
+        Disk_Preserve(iov[i].sector);
+        memcpy(Disk_Addr(iov[i].sector), iov[i].buffer, sectorSize);
+        Disk_MarkDirty(iov[i].sector);
+        Disk_UpdateSum(iov[i].sector);
+        Disk_Account(iov[i].sector, 1, true);
+    }
+    return 0;
+}
 
 /*
- * Disk_Init
+ * Disk_ReadRange
  *
- * Initializes the disk area (really just some memory for now).
+ * Reads "count" consecutive sectors starting at "sector" into one buffer.
+ */
+int Disk_ReadRange(int sector, int count, char* buffer)
+{
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (count > numSectors - sector) || (buffer == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    Disk_StripeGuard guard(Disk_RangeStripes(sector, count));
+    Disk_PageGuard pages(sector, count, false);
+    if (pages.failed) {
+        return -1;
+    }
+    for (int i = sector; i < sector + count; i++) {
+        if (Disk_CheckSum(i) == -1) {
+            return -1;
+        }
+    }
+
+    memcpy(buffer, Disk_Addr(sector), (size_t) count * sectorSize);
+    Disk_Account(sector, count, false);
+    return 0;
+}
+
+/*
+ * Disk_WriteRange
  *
- * THIS FUNCTION MUST BE CALLED BEFORE ANY OTHER FUNCTION IN HERE CAN BE USED!
+ * Writes "count" consecutive sectors starting at "sector" from one buffer.
+ */
+int Disk_WriteRange(int sector, int count, char* buffer)
+{
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (count > numSectors - sector) || (buffer == NULL)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    Disk_StripeGuard guard(Disk_RangeStripes(sector, count));
+    Disk_PageGuard pages(sector, count, true);
+    if (pages.failed) {
+        return -1;
+    }
+    for (int i = sector; i < sector + count; i++) {
+        Disk_Preserve(i);
+    }
+
+    memcpy(Disk_Addr(sector), buffer, (size_t) count * sectorSize);
+    for (int i = sector; i < sector + count; i++) {
+        Disk_MarkDirty(i);
+        Disk_UpdateSum(i);
+    }
+    Disk_Account(sector, count, true);
+    return 0;
+}
+
+/*
+ * Disk_Discard
  *
+ * Says "count" sectors starting at "sector" are no longer in use (TRIM).
+ * They read back as zeroes from now on, whole pages of them are handed
+ * back to the kernel, and the image file behind the disk (the mapped or
+ * paged file, or the one it was last saved to or loaded from) gets a hole
+ * punched over them along with their new checksums, so those sectors
+ * don't need saving again.
  */
-int Disk_Init()
+int Disk_Discard(int sector, int count)
 {
-    // create the disk image and fill every sector with zeroes
-    disk = (Sector *) calloc(NUM_SECTORS, sizeof(Sector));
-    if(disk == NULL) {
-    diskErrno = E_MEM_OP;
-    return -1;
+    // quick error checks
+    if ((sector < 0) || (count < 0) || (count > numSectors - sector)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+    if (count == 0) {
+        return 0;
+    }
+    Disk_StripeGuard guard(Disk_RangeStripes(sector, count));
+    for (int i = sector; i < sector + count; i++) {
+        Disk_Preserve(i);
+    }
+
+    // zero them in memory
+#ifndef WIN32
+    if (pagedFd != -1) {
+        if (Disk_PagedDiscard(sector, count) == -1) {
+            return -1;
+        }
+    } else if (mappedFd != -1) {
+        memset(Disk_Addr(sector), 0, (size_t) count * sectorSize);
+    } else {
+        Disk_ZeroSpan((size_t) sector * sectorSize, (size_t)(sector + count) * sectorSize);
+    }
+#else
+    memset(Disk_Addr(sector), 0, (size_t) count * sectorSize);
+#endif
+    std::vector<char> zero(sectorSize, 0);
+    unsigned int zeroSum = Disk_Crc32c(zero.data(), sectorSize);
+    for (int i = sector; i < sector + count; i++) {
+        sectorSums[i] = zeroSum;
+        verifiedBits[i / 64] |= 1ULL << (i % 64);
+        Disk_MarkDirty(i);
+    }
+
+#ifndef WIN32
+    // and in the file, if it's a whole image of this disk
+    int fd = (mappedFd != -1) ? mappedFd : pagedFd;
+    bool own = (fd != -1);
+    struct stat st;
+    if (!own && syncedPath != NULL && (fd = open(syncedPath, O_WRONLY)) != -1 &&
+        (fstat(fd, &st) == -1 || (size_t) st.st_size != Disk_Bytes() + Disk_SumBytes())) {
+        close(fd);
+        fd = -1;
+    }
+    if (pagedFd != -1 && Disk_PunchHole(fd, sector, count) == -1) {
+        // dropped blocks get read back from the file, so it needs the zeroes
+        for (int i = sector; i < sector + count; i++) {
+            if (Disk_PWriteAll(fd, zero.data(), sectorSize, (off_t) i * sectorSize) == -1) {
+                diskErrno = E_WRITING_FILE;
+                return -1;
+            }
+        }
+    } else if (fd != -1) {
+        // a mapped disk's checksums are in the mapping already
+        if (Disk_PunchHole(fd, sector, count) == 0 &&
+            (mappedFd != -1 || Disk_PWriteAll(fd, (char*)(sectorSums + sector), (size_t) count * sizeof(unsigned int),
+                                              (off_t)(Disk_Bytes() + (size_t) sector * sizeof(unsigned int))) == 0)) {
+            Disk_ClearDirty(sector, count);
+        }
+        if (!own) {
+            close(fd);
+        }
     }
+#endif
     return 0;
 }
 
 /*
- * Disk_Save
+ * Disk_ReadRef
  *
- * Makes sure the current disk image gets saved to memory - this
- * will overwrite an existing file with the same name so be careful
+ * Returns a read-only pointer straight into the disk for the given sector
+ * (Disk_SectorSize() bytes), or NULL on error. Nothing is copied; the pointer is only valid until the
+ * next call into the disk, and holds no lock, so another thread writing
+ * the same sector meanwhile will be seen half done.
  */
-int Disk_Save(char* file) {
-    FILE* diskFile;
-    
+const char* Disk_ReadRef(int sector)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return NULL;
+    }
+    {
+        Disk_StripeGuard guard(Disk_SectorStripe(sector));
+        Disk_PageGuard pages(sector, 1, false);
+        if (pages.failed || Disk_CheckSum(sector) == -1) {
+            return NULL;
+        }
+        Disk_BorrowSector(sector);  // a paged disk keeps it in until our next call
+    }
+
+    Disk_Account(sector, 1, false);
+    return Disk_Addr(sector);
+}
+
+/*
+ * Disk_WriteBegin
+ *
+ * Returns a writable pointer straight into the disk for the given sector
+ * (Disk_SectorSize() bytes), or NULL on error. The caller changes the sector in place and must then
+ * call Disk_WriteCommit on it before making any other disk call. The
+ * sector's stripe stays locked in between, so other threads never see a
+ * half-made update.
+ */
+char* Disk_WriteBegin(int sector)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return NULL;
+    }
+    Disk_LockStripes(Disk_SectorStripe(sector));
+    if (Disk_PinSectors(sector, 1, true) == -1) {
+        Disk_UnlockStripes(Disk_SectorStripe(sector));
+        return NULL;
+    }
+
+    // the caller will build on what's there, so it had better be intact
+    if (Disk_CheckSum(sector) == -1) {
+        Disk_UnpinSectors(sector, 1);
+        Disk_UnlockStripes(Disk_SectorStripe(sector));
+        return NULL;
+    }
+    Disk_Preserve(sector);
+
+    return Disk_Addr(sector);
+}
+
+/*
+ * Disk_WriteCommit
+ *
+ * Finishes an in-place update started with Disk_WriteBegin.
+ */
+int Disk_WriteCommit(int sector)
+{
+    // quick error checks
+    if ((sector < 0) || (sector >= numSectors)) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    // remember what needs saving, then let other threads at it again
+    Disk_MarkDirty(sector);
+    Disk_UpdateSum(sector);
+    Disk_UnpinSectors(sector, 1);
+    Disk_UnlockStripes(Disk_SectorStripe(sector));
+    Disk_Account(sector, 1, true);
+    return 0;
+}
+
+/*
+ * Disk_Checkpoint
+ *
+ * Freezes the current contents of the disk and returns a handle for
+ * Disk_Restore, or -1 on error. Nothing is copied now; each sector is
+ * copied the first time it is written afterwards.
+ */
+int Disk_Checkpoint()
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the epoch changes
+
+    // a paged disk has nowhere to keep the old sectors
+    if (pagedFd != -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    Cow_Checkpoint* checkpoint = new Cow_Checkpoint();
+    checkpoint->id = nextCheckpointId++;
+    checkpoint->epoch = ++lastEpoch;
+    checkpoint->dirty.assign(dirtyBits, dirtyBits + dirtyWords);
+    checkpoints.push_back(checkpoint);
+    cowEpoch = checkpoint->epoch;
+    return checkpoint->id;
+}
+
+/*
+ * Disk_Restore
+ *
+ * Puts the disk back the way it was when the checkpoint was taken. Any
+ * newer checkpoints are thrown away; this one stays, so it can be
+ * restored again.
+ */
+int Disk_Restore(int checkpoint)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the whole disk changes hands
+
     // error check
-    if (file == NULL) {
-    diskErrno = E_INVALID_PARAM;
-    return -1;
+    int position = Disk_FindCheckpoint(checkpoint);
+    if (position == -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
     }
-    
-    // open the diskFile
-    if ((diskFile = fopen(file, "w")) == NULL) {
-    diskErrno = E_OPENING_FILE;
-    return -1;
+
+    // newest first, so a sector saved by several checkpoints ends up with
+    // the oldest copy (the one from when this checkpoint was taken)
+    for (int i = (int) checkpoints.size() - 1; i >= position; i--) {
+        Cow_Checkpoint* newer = checkpoints[i];
+        for (std::unordered_map<int, size_t>::iterator it = newer->slots.begin(); it != newer->slots.end(); it++) {
+            memcpy(Disk_Addr(it->first), &newer->saved[it->second], sectorSize);
+            Disk_MarkDirty(it->first);
+            Disk_UpdateSum(it->first);
+        }
     }
-    
-    // actually write the disk image to a file
-    if ((fwrite(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
-    fclose(diskFile);
+
+    // the disk matches the checkpoint again, so start it over in a new epoch
+    Disk_DropCheckpoints(position + 1);
+    Cow_Checkpoint* restored = checkpoints.back();
+    restored->saved.clear();
+    restored->slots.clear();
+    restored->epoch = ++lastEpoch;
+    cowEpoch = restored->epoch;
+    return 0;
+}
+
+/*
+ * Disk_ReleaseCheckpoint
+ *
+ * Forgets a checkpoint. Sectors it saved that the next older checkpoint
+ * doesn't have are handed down to it, since they're that one's too.
+ */
+int Disk_ReleaseCheckpoint(int checkpoint)
+{
+    Disk_WholeDiskGuard whole;  // no sector I/O while the epoch changes
+
+    // error check
+    int position = Disk_FindCheckpoint(checkpoint);
+    if (position == -1) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
+    }
+
+    Cow_Checkpoint* released = checkpoints[position];
+    if (position > 0) {
+        Cow_Checkpoint* older = checkpoints[position - 1];
+        for (std::unordered_map<int, size_t>::iterator it = released->slots.begin(); it != released->slots.end(); it++) {
+            if (older->slots.find(it->first) == older->slots.end()) {
+                older->slots[it->first] = older->saved.size();
+                older->saved.insert(older->saved.end(), &released->saved[it->second], &released->saved[it->second] + sectorSize);
+            }
+        }
+    }
+
+    delete released;
+    checkpoints.erase(checkpoints.begin() + position);
+    cowEpoch = checkpoints.empty() ? 0 : checkpoints.back()->epoch;
+    return 0;
+}
+
+/*
+ * Disk_SaveCheckpoint
+ *
+ * Writes "count" sectors starting at "sector", as they were when the
+ * checkpoint was taken, to the file the disk was last saved to or loaded
+ * from, and makes them durable. Only the ones that needed saving then are
+ * written. Other threads' I/O goes on meanwhile; each group of sectors is
+ * locked just long enough to copy it out. Afterwards the sectors written
+ * no more since the checkpoint count as saved. The checkpoint has to stay
+ * around until this returns.
+ */
+int Disk_SaveCheckpoint(char* file, int checkpoint, int sector, int count)
+{
+#ifdef WIN32
     diskErrno = E_WRITING_FILE;
     return -1;
+#else
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    long long moved = 0;
+    struct stat st;
+    int fd;
+
+    {
+        Disk_WholeDiskGuard whole;  // just for the checks
+
+        // error check (it patches the file in place, so that has to be a whole image of this disk)
+        if (file == NULL || Disk_FindCheckpoint(checkpoint) == -1 || (sector < 0) || (count < 0) || (count > numSectors - sector) ||
+            mappedPath != NULL || syncedPath == NULL || strcmp(file, syncedPath) != 0) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+        if ((fd = open(file, O_WRONLY)) == -1) {
+            diskErrno = E_OPENING_FILE;
+            return -1;
+        }
+        if (fstat(fd, &st) == -1 || (size_t)st.st_size != Disk_Bytes() + Disk_SumBytes()) {
+            close(fd);
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
+    }
+
+    // a dirtyBits word (one stripe group) at a time: copy the sectors out
+    // with the group locked, then write each run of them and their checksums
+    std::vector<char> data((size_t) 64 * sectorSize);
+    std::vector<unsigned int> sums(64);
+    for (int group = sector / 64; count > 0 && group <= (sector + count - 1) / 64; group++) {
+        int lo = (sector > group * 64) ? sector - group * 64 : 0;
+        int hi = (sector + count < group * 64 + 64) ? sector + count - group * 64 : 64;
+        unsigned long long range = ((hi == 64) ? ~0ULL : (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+        unsigned long long mask;
+        {
+            Disk_StripeGuard guard(Disk_SectorStripe(group * 64));
+            int position = Disk_FindCheckpoint(checkpoint);
+            if (position == -1) {
+                close(fd);
+                diskErrno = E_INVALID_PARAM;
+                return -1;
+            }
+            mask = checkpoints[position]->dirty[group] & range;
+
+            // a sector written since is in the oldest checkpoint from this one on that saved it
+            std::lock_guard<std::mutex> saved(checkpointLock);
+            for (unsigned long long bits = mask; bits != 0; bits &= bits - 1) {
+                int bit = Disk_Ctz(bits);
+                int i = group * 64 + bit;
+                const char* from = Disk_Addr(i);
+                for (size_t c = position; c < checkpoints.size(); c++) {
+                    std::unordered_map<int, size_t>::iterator slot = checkpoints[c]->slots.find(i);
+                    if (slot != checkpoints[c]->slots.end()) {
+                        from = &checkpoints[c]->saved[slot->second];
+                        break;
+                    }
+                }
+                memcpy(&data[(size_t) bit * sectorSize], from, sectorSize);
+                sums[bit] = Disk_Crc32c(from, sectorSize);
+            }
+        }
+
+        for (int bit = 0; bit < 64; bit++) {
+            if (!((mask >> bit) & 1)) {
+                continue;
+            }
+            int run = bit;
+            while (bit < 64 && ((mask >> bit) & 1)) {
+                bit++;
+            }
+            int first = group * 64 + run;
+            if (Disk_PWriteAll(fd, &data[(size_t) run * sectorSize], (size_t)(bit - run) * sectorSize, (off_t) first * sectorSize) == -1 ||
+                Disk_PWriteAll(fd, (char*) &sums[run], (size_t)(bit - run) * sizeof(unsigned int),
+                               (off_t)(Disk_Bytes() + (size_t) first * sizeof(unsigned int))) == -1) {
+                close(fd);
+                diskErrno = E_WRITING_FILE;
+                return -1;
+            }
+            moved += (long long)(bit - run) * sectorSize;
+        }
+    }
+
+    if (fsync(fd) == -1) {
+        close(fd);
+        diskErrno = E_WRITING_FILE;
+        return -1;
+    }
+    close(fd);
+    Disk_RecordTransfer(moved, start);
+
+    // what hasn't been written again since the checkpoint is saved now
+    Disk_WholeDiskGuard whole;
+    int position = Disk_FindCheckpoint(checkpoint);
+    if (position != -1 && syncedPath != NULL && strcmp(file, syncedPath) == 0) {
+        Cow_Checkpoint* saved = checkpoints[position];
+        for (int i = sector; i < sector + count; i++) {
+            if (((saved->dirty[i / 64] >> (i % 64)) & 1) && sectorEpoch[i] < saved->epoch) {
+                dirtyBits[i / 64] &= ~(1ULL << (i % 64));
+            }
+        }
     }
-    
-    // clean up and return
-    fclose(diskFile);
     return 0;
+#endif
 }
 
 /*
- * Disk_Load
+ * Disk_SetDirectIO
  *
- * Loads a current disk image from disk into memory - requires that
- * the disk be created first.
+ * Turns direct I/O for image files on or off. Fails if this system has no
+ * O_DIRECT; a filesystem that refuses it just gets normal I/O.
  */
-int Disk_Load(char* file) {
-    FILE* diskFile;
-    
-    // error check
-    if (file == NULL) {
+int Disk_SetDirectIO(int enabled)
+{
+#ifdef O_DIRECT
+    Disk_WholeDiskGuard whole;  // not halfway through a save or load
+
+    directIO = (enabled != 0);
+    return 0;
+#else
+    if (!enabled) {
+        return 0;
+    }
     diskErrno = E_INVALID_PARAM;
     return -1;
+#endif
+}
+
+/*
+ * Disk_SetImageThreads
+ *
+ * How many threads Disk_Save and Disk_Load split the image between; 0
+ * goes back to one per core (up to IMAGE_MAX_THREADS).
+ */
+int Disk_SetImageThreads(int threads)
+{
+    Disk_WholeDiskGuard whole;  // not halfway through a save or load
+
+    if (threads < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
     }
-    
-    // open the diskFile
-    if ((diskFile = fopen(file, "r")) == NULL) {
-    diskErrno = E_OPENING_FILE;
-    return -1;
+    imageThreads = threads;
+    return 0;
+}
+
+/*
+ * Disk_SetVerifyReads
+ *
+ * Turns checking sectors against their checksums on reads on or off.
+ * Writes keep the checksums up to date either way, so images stay whole.
+ */
+int Disk_SetVerifyReads(int enabled)
+{
+    Disk_WholeDiskGuard whole;  // no read halfway through a check
+
+    verifyReads = (enabled != 0);
+    return 0;
+}
+
+/*
+ * Disk_SetLatencyModel
+ *
+ * Picks how simulated service time is charged from now on.
+ */
+void Disk_SetLatencyModel(Disk_Latency_t model)
+{
+    latencyModel = model;
+}
+
+/*
+ * Disk_GetStats
+ *
+ * Copies out the I/O counters gathered since the last Disk_ResetStats.
+ */
+int Disk_GetStats(Disk_Stats* out)
+{
+    if (out == NULL) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
     }
-    
-    // actually read the disk image into memory
-    if ((fread(disk, sizeof(Sector), NUM_SECTORS, diskFile)) != NUM_SECTORS) {
-    fclose(diskFile);
-    diskErrno = E_READING_FILE;
-    return -1;
+
+    // add up every thread's shard, less what was there at the last reset
+    std::lock_guard<std::mutex> guard(statsLock);
+    memset(out, 0, sizeof(Disk_Stats));
+    for (size_t i = 0; i < statsShards.size(); i++) {
+        out->reads += statsShards[i]->reads.load(std::memory_order_relaxed);
+        out->writes += statsShards[i]->writes.load(std::memory_order_relaxed);
+        out->seeks += statsShards[i]->seeks.load(std::memory_order_relaxed);
+        out->seekDistance += statsShards[i]->seekDistance.load(std::memory_order_relaxed);
+        out->serviceTime += statsShards[i]->serviceTime.load(std::memory_order_relaxed);
+        out->imageBytes += statsShards[i]->imageBytes.load(std::memory_order_relaxed);
+        out->imageTime += statsShards[i]->imageTime.load(std::memory_order_relaxed);
     }
-    
-    // clean up and return
-    fclose(diskFile);
+    out->reads -= statsBase.reads;
+    out->writes -= statsBase.writes;
+    out->seeks -= statsBase.seeks;
+    out->seekDistance -= statsBase.seekDistance;
+    out->serviceTime -= statsBase.serviceTime;
+    out->imageBytes -= statsBase.imageBytes;
+    out->imageTime -= statsBase.imageTime;
     return 0;
 }
 
 /*
- * Disk_Read
+ * Disk_ResetStats
  *
- * Reads a single sector from "disk" and puts it into a buffer provided
- * by the user.
+ * Zeroes the I/O counters and parks the head at sector 0.
  */
-int Disk_Read(int sector, char* buffer) {
+void Disk_ResetStats()
+{
+    // the shards belong to their threads, so instead of zeroing them
+    // remember where they stand now
+    Disk_Stats now;
+    Disk_GetStats(&now);
+    std::lock_guard<std::mutex> guard(statsLock);
+    statsBase.reads += now.reads;
+    statsBase.writes += now.writes;
+    statsBase.seeks += now.seeks;
+    statsBase.seekDistance += now.seekDistance;
+    statsBase.serviceTime += now.serviceTime;
+    statsBase.imageBytes += now.imageBytes;
+    statsBase.imageTime += now.imageTime;
+    lastSector = 0;
+}
+
+/*
+ * Disk_AsyncWorker
+ *
+ * Body of each async worker thread: run requests until told to stop.
+ */
+static void Disk_AsyncWorker()
+{
+    std::unique_lock<std::mutex> lock(asyncLock);
+    while (true) {
+        asyncWork.wait(lock, [] { return asyncStopping || !submitQueue.empty(); });
+        if (submitQueue.empty()) {
+            return; // stopping, and nothing left to do
+        }
+        Disk_Request* request = submitQueue.front();
+        submitQueue.pop_front();
+        lock.unlock();
+
+        // the disk does its own locking, so workers run requests side by side
+        if (request->op == DISK_OP_READ) {
+            request->result = Disk_Read(request->sector, request->buffer);
+        } else if (request->op == DISK_OP_WRITE) {
+            request->result = Disk_Write(request->sector, request->buffer);
+        } else {
+            request->result = -1;
+            diskErrno = E_INVALID_PARAM;
+        }
+        request->error = diskErrno;
+
+        lock.lock();
+        doneQueue.push_back(request);
+        asyncDone.notify_all();
+    }
+}
+
+/*
+ * Disk_AsyncStop
+ *
+ * Lets the workers drain the queue and joins them (run at exit).
+ */
+static void Disk_AsyncStop()
+{
+    {
+        std::lock_guard<std::mutex> guard(asyncLock);
+        asyncStopping = true;
+    }
+    asyncWork.notify_all();
+    for (size_t i = 0; i < asyncWorkers.size(); i++) {
+        asyncWorkers[i].join();
+    }
+    asyncWorkers.clear();
+}
+
+/*
+ * Disk_Submit
+ *
+ * Queues "count" requests and returns right away. Each request's buffer
+ * must stay put until the request comes back from Disk_Poll/Disk_Wait.
+ * Returns the number of requests queued.
+ */
+int Disk_Submit(Disk_Request** requests, int count)
+{
     // quick error checks
-    if ((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
-    diskErrno = E_INVALID_PARAM;
-    return -1;
+    if (requests == NULL || count < 0) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
     }
-    
-    // copy the memory for the user
-    if((memcpy((void*)buffer, (void*)(disk + sector), sizeof(Sector))) == NULL) {
-    diskErrno = E_MEM_OP;
-    return -1;
+    for (int i = 0; i < count; i++) {
+        if (requests[i] == NULL) {
+            diskErrno = E_INVALID_PARAM;
+            return -1;
+        }
     }
-    
-    return 0;
+
+    std::lock_guard<std::mutex> guard(asyncLock);
+
+    // start the workers the first time around
+    if (asyncWorkers.empty()) {
+        unsigned int workers = std::thread::hardware_concurrency();
+        if (workers == 0 || workers > ASYNC_MAX_WORKERS) {
+            workers = ASYNC_MAX_WORKERS;
+        }
+        for (unsigned int i = 0; i < workers; i++) {
+            asyncWorkers.push_back(std::thread(Disk_AsyncWorker));
+        }
+        atexit(Disk_AsyncStop);
+    }
+
+    for (int i = 0; i < count; i++) {
+        submitQueue.push_back(requests[i]);
+    }
+    asyncWork.notify_all();
+    return count;
 }
 
 /*
- * Disk_Write
+ * Disk_Poll
  *
- * Writes a single sector from memory to "disk".
+ * Reaps up to "max" completed requests without blocking. Returns how
+ * many were put in "done".
  */
-int Disk_Write(int sector, char* buffer) 
+int Disk_Poll(Disk_Request** done, int max)
+{
+    return Disk_Wait(done, 0, max);
+}
+
+/*
+ * Disk_Wait
+ *
+ * Blocks until at least "min" requests have completed, then reaps up to
+ * "max" of them. Returns how many were put in "done".
+ */
+int Disk_Wait(Disk_Request** done, int min, int max)
 {
     // quick error checks
-    if((sector < 0) || (sector >= NUM_SECTORS) || (buffer == NULL)) {
-    diskErrno = E_INVALID_PARAM;
-    return -1;
+    if (done == NULL || min < 0 || max < min) {
+        diskErrno = E_INVALID_PARAM;
+        return -1;
     }
-    
-    // copy the memory for the user
-    if((memcpy((void*)(disk + sector), (void*)buffer, sizeof(Sector))) == NULL) {
-    diskErrno = E_MEM_OP;
-    return -1;
+
+    std::unique_lock<std::mutex> lock(asyncLock);
+    asyncDone.wait(lock, [min] { return doneQueue.size() >= (size_t) min; });
+
+    int reaped = 0;
+    while (reaped < max && !doneQueue.empty()) {
+        done[reaped++] = doneQueue.front();
+        doneQueue.pop_front();
     }
-    return 0;
+    return reaped;
 }
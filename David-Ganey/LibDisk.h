@@ -17,14 +17,18 @@
 #include	<errno.h>
 #include	<fcntl.h>
 #include    <string.h>
+#include    <math.h>
 #ifdef WIN32
 #include    <io.h>
+#include    <intrin.h>
 #else
 #include    <unistd.h>
+#include    <sys/mman.h>
 #endif
-// a few disk parameters
+// a few disk parameters (the default geometry, see Disk_InitGeometry)
 #define SECTOR_SIZE  512
 #define NUM_SECTORS  1000
+#define MAX_SECTOR_SIZE  4096
 
 // disk errors
 typedef enum {
@@ -33,18 +37,151 @@ typedef enum {
   E_OPENING_FILE,
   E_WRITING_FILE,
   E_READING_FILE,
+  E_MAPPING_FILE,
+  E_CHECKSUM,        // a sector no longer matches the checksum it was saved with
 } Disk_Error_t;
 
+// flags for Disk_Map
+#define DISK_MAP_POPULATE  0x1   // prefault the whole image at map time
+#define DISK_MAP_HUGEPAGE  0x2   // advise the kernel to back the image with huge pages
+
+// a sector of the default geometry (SECTOR_SIZE bytes); sectors are
+// Disk_SectorSize() bytes, which can be more
 typedef struct sector {
   char data[SECTOR_SIZE];
 } Sector;
 
-extern Disk_Error_t diskErrno; // used to see what happened w/ disk ops
+// one piece of a vectored read or write
+typedef struct disk_iovec {
+  int sector;
+  char* buffer;
+} Disk_IOVec;
+
+// latency models for Disk_SetLatencyModel
+typedef enum {
+  DISK_LATENCY_NONE,   // just count
+  DISK_LATENCY_HDD,    // seek + rotation + transfer
+  DISK_LATENCY_SSD,    // fixed cost per request + transfer
+} Disk_Latency_t;
+
+// I/O counters, see Disk_GetStats
+typedef struct disk_stats {
+  long long reads;          // sectors read
+  long long writes;         // sectors written
+  long long seeks;          // requests that didn't start where the last one ended
+  long long seekDistance;   // total sectors the head traveled
+  double serviceTime;       // simulated time in microseconds
+  long long imageBytes;     // bytes Disk_Save/Disk_Load actually moved to or from files
+  double imageTime;         // wall time that took, in seconds
+} Disk_Stats;
+
+// asynchronous requests, see Disk_Submit
+typedef enum {
+  DISK_OP_READ,
+  DISK_OP_WRITE,
+} Disk_Op_t;
+
+typedef struct disk_request {
+  Disk_Op_t op;
+  int sector;
+  char* buffer;
+  int result;           // 0 or -1 once the request completes
+  Disk_Error_t error;   // diskErrno of a failed request
+  void* user;           // for the caller, never touched
+} Disk_Request;
+
+// every call below is safe to make from several threads at once; each
+// thread has its own diskErrno (like errno, it's really a function call).
+// Including this header is all a driver needs: an old
+// "extern Disk_Error_t diskErrno;" line still compiles, but as a
+// redeclaration of Disk_Errno, which -Wall warns about (-Wparentheses)
+Disk_Error_t* Disk_Errno();
+#define diskErrno (*Disk_Errno()) // used to see what happened w/ disk ops
 
 int Disk_Init();
+int Disk_InitGeometry(int size, int count);
+int Disk_SectorSize();
+int Disk_NumSectors();
+
+// adds "count" - Disk_NumSectors() zeroed sectors to the end of the disk,
+// keeping everything on it in place (and its image file a whole image)
+int Disk_Grow(int count);
 int Disk_Save(char* file);
+int Disk_SaveIncremental(char* file);
+int Disk_SaveRange(char* file, int sector, int count);
 int Disk_Load(char* file);
 int Disk_Write(int sector, char* buffer);
 int Disk_Read(int sector, char* buffer);
+int Disk_Map(char* file, int flags);
+
+// direct I/O: Disk_Save, Disk_Load and friends bypass the page cache, moving
+// the image in big aligned transfers (off by default; no effect on Disk_Map)
+int Disk_SetDirectIO(int enabled);
+
+// Disk_Save and Disk_Load split the image into chunks moved by several
+// threads at once; this sets how many (0, the default, is one per core)
+int Disk_SetImageThreads(int threads);
+
+// a sector is checked against its CRC32C the first time it's read after a
+// load (a mismatch fails the read with E_CHECKSUM); this turns the check
+// off or back on, without touching the checksums themselves
+int Disk_SetVerifyReads(int enabled);
+
+// demand paging, for images bigger than memory: the file becomes the disk
+// and sectors are read in as they're touched, keeping at most "memoryLimit"
+// bytes of them resident (changed ones are written back when dropped). Uses
+// the current geometry, and lasts until the next Disk_InitGeometry or
+// Disk_Map; compressed and striped saves and checkpoints aren't available.
+int Disk_OpenPaged(char* file, size_t memoryLimit);
+
+// compressed images: sectors are compressed in independent groups with an
+// index up front, so Disk_ReadCompressed can pull out any one sector alone
+int Disk_SaveCompressed(char* file);
+int Disk_LoadCompressed(char* file);
+int Disk_ReadCompressed(char* file, int sector, char* buffer);
+
+// striped images: the disk spread over several files (ideally on different
+// devices), "stripeSectors" at a time, each file written/read by its own thread
+int Disk_SaveStriped(char** files, int numFiles, int stripeSectors);
+int Disk_LoadStriped(char** files, int numFiles, int stripeSectors);
+
+// move many sectors in one call (all of them are checked before any is copied)
+int Disk_ReadV(Disk_IOVec* iov, int count);
+int Disk_WriteV(Disk_IOVec* iov, int count);
+int Disk_ReadRange(int sector, int count, char* buffer);
+int Disk_WriteRange(int sector, int count, char* buffer);
+
+// discard (TRIM): the sectors become zeroes and their space in memory and
+// in the image file is given back
+int Disk_Discard(int sector, int count);
+
+// borrow sectors in place instead of copying them; a borrowed pointer is to
+// the sector's Disk_SectorSize() bytes and only good until the next call
+// into the disk. Other threads are kept off a sector between Disk_WriteBegin
+// and Disk_WriteCommit, but not off one borrowed with Disk_ReadRef.
+const char* Disk_ReadRef(int sector);
+char* Disk_WriteBegin(int sector);
+int Disk_WriteCommit(int sector);
+
+// copy-on-write checkpoints: taking one is cheap, and it only costs memory
+// for the sectors written after it
+int Disk_Checkpoint();
+int Disk_Restore(int checkpoint);
+int Disk_ReleaseCheckpoint(int checkpoint);
+
+// writes sectors as they were at a checkpoint back to the disk's own image
+// file while other threads keep using the disk, for background syncs
+int Disk_SaveCheckpoint(char* file, int checkpoint, int sector, int count);
+
+// asynchronous I/O: submit a batch, then poll or wait for completions.
+// requests in flight may run in any order, alongside the caller's own calls
+int Disk_Submit(Disk_Request** requests, int count);
+int Disk_Poll(Disk_Request** done, int max);
+int Disk_Wait(Disk_Request** done, int min, int max);
+
+// simulated timing and statistics
+void Disk_SetLatencyModel(Disk_Latency_t model);
+int Disk_GetStats(Disk_Stats* stats);
+void Disk_ResetStats();
 
 #endif // __Disk_H__
@@ -1,4 +1,5 @@
 #include "LibFS.h"
+#include "LibFSInternal.h"
 #include "LibDisk.h"
 
 #include <string>
@@ -6,6 +7,9 @@
 #include <iostream>
 #include <math.h>
 #include <unordered_map>
+#include <set>
+#include <algorithm>
+#include <future>
 
 // global errno value here
 int osErrno;
@@ -14,17 +18,34 @@ int totalFilesAndDirectories = 0;
 int fileDescriptorCount = 0;
 char* magicString = "666";
 char* bootPath; //we'll populate this after boot so we can call sync
+bool mapDiskImage = false; //boot straight off an mmap of the image instead of reading it all in
+int journalGroupOps = 0; //commit to the journal on our own after this many operations (0 = only on FS_Commit, or once a record is filling up)
 
 //structs
 typedef struct superblock
 {
     char magic[4]; //one extra for \0
-    char garbage[SECTOR_SIZE - 4];
+    //geometry and layout, recorded at format time (all 0 on images from before they were recorded)
+    int sectorSize;
+    int numSectors;
+    int numInodes;
+    int inodeBitmapStart;
+    int inodeBitmapSectors;
+    int dataBitmapStart;
+    int dataBitmapSectors;
+    int inodeTableStart;
+    int firstDataBlock;
+    int numDataBlocks;
+    int journalStart; //0 sectors on images from before the journal
+    int journalSectors;
+    int dataBitmapMoreStart; //the rest of the data bitmap, once FS_Grow outgrows the sectors above (0 sectors before)
+    int dataBitmapMoreSectors;
+    char garbage[SECTOR_SIZE - 4 - 14 * sizeof(int)];
 } Superblock;
 
 typedef struct inode
 {
-    int fileType; //0 represents file, 1 is a directory
+    int fileType; //0 represents file, 1 is a directory, 2 is a directory with a hash index
     int fileSize; //in bytes
     int pointers[NUM_POINTERS];
 } Inode;
@@ -36,42 +57,1025 @@ typedef struct directoryentry
     char garbage[12];
 } DirectoryEntry;
 
-typedef struct bitmap
+//A directory that fills all NUM_POINTERS of its blocks switches to a hash index (like ext3's htree):
+//its fileType becomes 2 and pointers[0] is the root of a tree of index blocks. An index block is a
+//header and a list of (hash, sector) pairs sorted by hash, each child holding the names that hash to
+//at least its own value and less than the next one's. The bottom children ("leaves") are ordinary
+//blocks of directory entries, and all the names with one hash are always in the same leaf
+typedef struct dxheader
 {
-    char bits[NUM_CHARS];
-    char garbage[SECTOR_SIZE - NUM_CHARS];
-} Bitmap;
+    int count; //entries in use
+    int levels; //index levels below this block (0 means its entries point at leaves)
+} DxHeader;
 
-typedef struct filedata
+typedef struct dxentry
 {
-    char contents[SECTOR_SIZE];
-} FileData;
+    unsigned int hash; //the lowest hash under this child (always 0 for the first one)
+    int sector;
+} DxEntry;
+
+const int DX_MAX_LEVELS = 8; //far more than any disk needs, anything deeper is damage
 
 typedef struct openfile
 {
-    int inodeNum;
-    int filepointer;
-    char garbage[SECTOR_SIZE - 2 * sizeof(int)];
-} OpenFile;
+    int inodeNum;
+    int filepointer;
+    char garbage[SECTOR_SIZE - 2 * sizeof(int)];
+} OpenFile;
+
+//Maps from file descriptors to open file structs
+typedef std::unordered_map<int, OpenFile> OpenFileMap;
+OpenFileMap openFileTable;
+
+//Inodes we've already decoded, by inode number, so lookups don't go back to the inode table
+//Changed ones stay dirty here until the journal commits or the file system syncs, and the inode
+//of every open file is pinned so it stays put for as long as an fd uses it
+typedef struct cachedinode
+{
+    Inode inode;
+    bool dirty; //changed since it was last written back to its sector
+    int pins; //fds in openFileTable using it
+} CachedInode;
+
+typedef std::unordered_map<int, CachedInode> InodeCache;
+InodeCache inodeCache;
+const int INODE_CACHE_ENTRIES = 1024; //when it gets this big, whatever isn't pinned is dropped
+
+//Names already looked up, by (directory inode, name): what the name is in that directory, or that
+//nothing there has it (a negative entry). Adding a name to a directory invalidates its entry
+typedef struct dentry
+{
+    int inodeNum; //-1 for a name that isn't there
+    int fileType; //of the inode it names
+} Dentry;
+
+typedef std::pair<int, std::string> DentryKey;
+struct DentryHash
+{
+    size_t operator()(const DentryKey& key) const
+    {
+        return std::hash<std::string>()(key.second) * 31 + key.first;
+    }
+};
+typedef std::unordered_map<DentryKey, Dentry, DentryHash> DentryCache;
+DentryCache dentryCache;
+const int DENTRY_CACHE_ENTRIES = 4096; //when it gets this big, it starts over
+
+//Metadata sectors (the inode table and directory blocks) are kept in a buffer cache between us and
+//the disk, so going back to one is a hash lookup instead of a copy. Changes stay in the cache until
+//the journal commits, the file system syncs or the slot is needed, and a CLOCK hand picks that slot
+typedef struct buffer
+{
+    int sector; //-1 while the slot is empty
+    bool dirty; //changed since it was read or last written back
+    bool referenced; //used since the hand last came by
+} Buffer;
+
+std::vector<Buffer> bufferSlots;
+std::vector<char> bufferData; //a sector per slot
+std::unordered_map<int, int> bufferMap; //sector -> slot
+int bufferCapacity = 256;
+size_t bufferHand = 0;
+FS_CacheStats bufferStats;
+
+//the layout of the booted disk, everything below is derived from it
+Superblock layout;
+int inodesPerBlock;
+int entriesPerBlock;
+
+//bitmaps, each spanning whole sectors
+char* inodeBitmap;
+char* dataBitmap;
+int inodeCursor = 0; //the next-fit cursors, one past the last bits handed out
+int dataCursor = 0;
+
+//the journal lives at the end of the disk: a header sector, then one record per commit made of
+//a descriptor (which sectors follow), copies of those sectors, then a commit sector
+//FS_Sync checkpoints everything into place and empties it again
+typedef struct journalblock
+{
+    char magic[4]; //"JHD" for the header, "JDS" for a descriptor, "JCM" for a commit
+    int sequence; //which record this belongs to (the header has the first one to replay)
+    int count; //how many sectors are in the record
+    unsigned int checksum; //commit only: covers the descriptor and the sectors
+} JournalBlock;
+
+const int JOURNAL_MIN_SECTORS = 16;
+
+std::set<int> journalPending; //sectors written since the last commit
+std::unordered_map<int, std::vector<char> > journalBefore; //what each of them held at the last commit
+std::set<int> releasedSectors; //data sectors given back since then, discarded once the free is durable
+int journalOps = 0; //operations since the last commit
+int journalNext; //where the next record goes
+int journalSequence; //sequence number of the next record
+
+//a sync running in the background (FS_SyncAsync): a checkpoint of the disk being written out
+//home, with everything up to it committed to the journal first in case we crash halfway
+std::future<int> syncSave;
+int syncCheckpoint = -1;
+int syncJournalNext; //where the journal ended when the checkpoint was taken
+int syncHandle = 0; //handle of the newest one
+
+//============ Helper Functions ============
+//The journal takes one sector in 16 at the very end (62 on the default disk, leaving it 683 data blocks
+//where images from before the journal have 746)
+int journalSize(int numSectors)
+{
+    return numSectors / 16 < JOURNAL_MIN_SECTORS ? JOURNAL_MIN_SECTORS : numSectors / 16;
+}
+
+//Works out where everything goes on a disk of the given geometry and stores it in layout
+//The default 512 x 1000 disk keeps the original fixed layout so old images still line up
+int computeLayout(int sectorSize, int numSectors)
+{
+    memset(&layout, 0, sizeof(Superblock));
+    if (sectorSize % sizeof(Inode) != 0 || sectorSize % sizeof(DirectoryEntry) != 0 || numSectors <= 0)
+    {
+        return -1;
+    }
+
+    layout.sectorSize = sectorSize;
+    layout.numSectors = numSectors;
+    int bitsPerSector = sectorSize * 8;
+    int inodesPerSector = sectorSize / sizeof(Inode);
+
+    if (sectorSize == SECTOR_SIZE && numSectors == NUM_SECTORS)
+    {
+        layout.numInodes = NUM_INODES;
+        layout.inodeBitmapStart = INODE_BITMAP_OFFSET;
+        layout.inodeBitmapSectors = 1;
+        layout.dataBitmapStart = DATA_BITMAP_OFFSET;
+        layout.dataBitmapSectors = 1;
+        layout.inodeTableStart = ROOT_INODE_OFFSET;
+        layout.firstDataBlock = FIRST_DATABLOCK_OFFSET;
+    }
+    else
+    {
+        //one inode for every 4 sectors, rounded up to whole inode sectors
+        int inodeSectors = (numSectors / 4 + inodesPerSector - 1) / inodesPerSector;
+        if (inodeSectors == 0)
+        {
+            inodeSectors = 1;
+        }
+        layout.numInodes = inodeSectors * inodesPerSector;
+        layout.inodeBitmapStart = SUPER_BLOCK_OFFSET + 1;
+        layout.inodeBitmapSectors = (layout.numInodes + bitsPerSector - 1) / bitsPerSector;
+        layout.dataBitmapStart = layout.inodeBitmapStart + layout.inodeBitmapSectors;
+        //sized for everything left over, which slightly overcounts (the table and bitmap themselves)
+        int leftOver = numSectors - layout.dataBitmapStart - inodeSectors;
+        layout.dataBitmapSectors = (leftOver + bitsPerSector - 1) / bitsPerSector;
+        layout.inodeTableStart = layout.dataBitmapStart + layout.dataBitmapSectors;
+        layout.firstDataBlock = layout.inodeTableStart + inodeSectors;
+    }
+
+    layout.journalSectors = journalSize(numSectors);
+    layout.journalStart = numSectors - layout.journalSectors;
+
+    layout.numDataBlocks = layout.journalStart - layout.firstDataBlock;
+    if (layout.numDataBlocks <= 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void bufferReset();
+
+//Sets up the derived sizes and (empty) bitmaps once layout is filled in
+void useLayout()
+{
+    strcpy(layout.magic, magicString);
+    inodesPerBlock = layout.sectorSize / sizeof(Inode);
+    entriesPerBlock = layout.sectorSize / sizeof(DirectoryEntry);
+
+    inodeCache.clear();
+    dentryCache.clear();
+    bufferReset();
+    inodeCursor = 0;
+    dataCursor = 0;
+    releasedSectors.clear();
+    free(inodeBitmap);
+    free(dataBitmap);
+    inodeBitmap = (char*)calloc(layout.inodeBitmapSectors, layout.sectorSize);
+    dataBitmap = (char*)calloc(layout.dataBitmapSectors + layout.dataBitmapMoreSectors, layout.sectorSize);
+}
+
+//Lists every bitmap sector with the part of the in-memory bitmaps it holds
+std::vector<Disk_IOVec> bitmapSectors()
+{
+    std::vector<Disk_IOVec> sectors;
+    for (int i = 0; i < layout.inodeBitmapSectors; i++)
+    {
+        Disk_IOVec io = { layout.inodeBitmapStart + i, inodeBitmap + i * layout.sectorSize };
+        sectors.push_back(io);
+    }
+    for (int i = 0; i < layout.dataBitmapSectors; i++)
+    {
+        Disk_IOVec io = { layout.dataBitmapStart + i, dataBitmap + i * layout.sectorSize };
+        sectors.push_back(io);
+    }
+    for (int i = 0; i < layout.dataBitmapMoreSectors; i++)
+    {
+        Disk_IOVec io = { layout.dataBitmapMoreStart + i, dataBitmap + (layout.dataBitmapSectors + i) * layout.sectorSize };
+        sectors.push_back(io);
+    }
+    return sectors;
+}
+
+//Remembers a changed sector for the next journal commit (called before it's written), along with
+//what it held until now in case the journal has to be emptied before the commit
+void journalTouch(int sector)
+{
+    if (layout.journalSectors > 0 && journalPending.insert(sector).second)
+    {
+        std::vector<char>& before = journalBefore[sector];
+        before.resize(layout.sectorSize);
+        Disk_Read(sector, before.data());
+    }
+}
+
+//Writes a sector and remembers it for the next journal commit
+int writeSector(int sector, char* buffer)
+{
+    journalTouch(sector);
+    return Disk_Write(sector, buffer);
+}
+
+//Same thing for a batch of sectors
+int writeSectors(std::vector<Disk_IOVec>& sectors)
+{
+    for (size_t i = 0; i < sectors.size(); i++)
+    {
+        journalTouch(sectors[i].sector);
+    }
+    return Disk_WriteV(sectors.data(), sectors.size());
+}
+
+//Empties the buffer cache (without writing anything back) and sizes it for the current layout
+void bufferReset()
+{
+    Buffer empty = { -1, false, false };
+    bufferSlots.assign(bufferCapacity, empty);
+    bufferData.assign((size_t)bufferCapacity * layout.sectorSize, 0);
+    bufferMap.clear();
+    bufferHand = 0;
+}
+
+char* bufferAddr(int slot)
+{
+    return &bufferData[(size_t)slot * layout.sectorSize];
+}
+
+//Finds a slot for a sector that isn't cached, writing back whatever the hand settles on if it's dirty
+int bufferVictim()
+{
+    while (true)
+    {
+        int slot = bufferHand;
+        bufferHand = (bufferHand + 1) % bufferSlots.size();
+        Buffer& buffer = bufferSlots[slot];
+        if (buffer.referenced)
+        {
+            buffer.referenced = false; //second chance
+            continue;
+        }
+
+        if (buffer.sector != -1)
+        {
+            if (buffer.dirty)
+            {
+                writeSector(buffer.sector, bufferAddr(slot));
+                bufferStats.writeBacks++;
+            }
+            bufferMap.erase(buffer.sector);
+        }
+        buffer.sector = -1;
+        buffer.dirty = false;
+        return slot;
+    }
+}
+
+//Returns the cached copy of a sector, reading it in on a miss (NULL if it can't be read)
+//The pointer is good until the next call that might bring another sector in
+char* bufferGet(int sector)
+{
+    std::unordered_map<int, int>::iterator it = bufferMap.find(sector);
+    if (it != bufferMap.end())
+    {
+        bufferStats.hits++;
+        bufferSlots[it->second].referenced = true;
+        return bufferAddr(it->second);
+    }
+
+    bufferStats.misses++;
+    int slot = bufferVictim();
+    if (Disk_Read(sector, bufferAddr(slot)) == -1)
+    {
+        return NULL;
+    }
+    bufferSlots[slot].sector = sector;
+    bufferSlots[slot].referenced = true;
+    bufferMap[sector] = slot;
+    return bufferAddr(slot);
+}
+
+//Marks a cached sector as changed, after editing it through bufferGet
+void bufferDirty(int sector)
+{
+    bufferSlots[bufferMap[sector]].dirty = true;
+}
+
+//Puts a whole new sector in the cache (no need to read what was there before)
+void bufferWrite(int sector, char* data)
+{
+    std::unordered_map<int, int>::iterator it = bufferMap.find(sector);
+    int slot = (it != bufferMap.end()) ? it->second : bufferVictim();
+    memcpy(bufferAddr(slot), data, layout.sectorSize);
+    bufferSlots[slot].sector = sector;
+    bufferSlots[slot].dirty = true;
+    bufferSlots[slot].referenced = true;
+    bufferMap[sector] = slot;
+}
+
+//Forgets a sector without writing it back, for one that's been freed
+void bufferDrop(int sector)
+{
+    std::unordered_map<int, int>::iterator it = bufferMap.find(sector);
+    if (it != bufferMap.end())
+    {
+        bufferSlots[it->second].sector = -1;
+        bufferSlots[it->second].dirty = false;
+        bufferSlots[it->second].referenced = false;
+        bufferMap.erase(it);
+    }
+}
+
+//Writes every dirty cached sector to the disk in one call, in sector order
+void bufferFlush()
+{
+    std::vector<Disk_IOVec> writes;
+    for (size_t i = 0; i < bufferSlots.size(); i++)
+    {
+        if (bufferSlots[i].sector != -1 && bufferSlots[i].dirty)
+        {
+            Disk_IOVec write = { bufferSlots[i].sector, bufferAddr(i) };
+            writes.push_back(write);
+            bufferSlots[i].dirty = false;
+        }
+    }
+    std::sort(writes.begin(), writes.end(), [](const Disk_IOVec& a, const Disk_IOVec& b) { return a.sector < b.sector; });
+    writeSectors(writes);
+    bufferStats.writeBacks += writes.size();
+}
+
+//Writes every dirty cached inode back into its sector in the buffer cache
+void inodeFlush()
+{
+    for (InodeCache::iterator it = inodeCache.begin(); it != inodeCache.end(); ++it)
+    {
+        if (!it->second.dirty)
+        {
+            continue;
+        }
+        int inodeSector = it->first / inodesPerBlock + layout.inodeTableStart;
+        char* block = bufferGet(inodeSector);
+        if (block == NULL)
+        {
+            continue;
+        }
+        ((Inode*)block)[it->first % inodesPerBlock] = it->second.inode;
+        bufferDirty(inodeSector);
+        it->second.dirty = false;
+    }
+}
+
+//Gets everything only changed in the caches onto the disk (nothing is synced or committed yet)
+void cacheFlush()
+{
+    inodeFlush();
+    bufferFlush();
+}
+
+//Returns the cached copy of an inode, reading it in on a miss (NULL if its sector can't be read)
+//The pointer is good until the next inodeGet, or for as long as the inode is pinned
+Inode* inodeGet(int inodeNum)
+{
+    InodeCache::iterator it = inodeCache.find(inodeNum);
+    if (it != inodeCache.end())
+    {
+        return &it->second.inode;
+    }
+
+    //full, so write back what changed and keep only the pinned ones
+    if ((int)inodeCache.size() >= INODE_CACHE_ENTRIES)
+    {
+        inodeFlush();
+        for (it = inodeCache.begin(); it != inodeCache.end();)
+        {
+            if (it->second.pins == 0)
+            {
+                it = inodeCache.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    int inodeSector = inodeNum / inodesPerBlock + layout.inodeTableStart;
+    const Inode* inodeBlock = (const Inode*)bufferGet(inodeSector);
+    if (inodeBlock == NULL)
+    {
+        return NULL;
+    }
+
+    CachedInode entry;
+    entry.inode = inodeBlock[inodeNum % inodesPerBlock];
+    entry.dirty = false;
+    entry.pins = 0;
+    return &inodeCache.insert(std::make_pair(inodeNum, entry)).first->second.inode;
+}
+
+//Marks a cached inode as changed, after editing it through inodeGet
+void inodeDirty(int inodeNum)
+{
+    inodeCache[inodeNum].dirty = true;
+}
+
+//Keeps an inode in the cache while an fd uses it (it has to be cached already)
+void inodePin(int inodeNum)
+{
+    inodeCache[inodeNum].pins++;
+}
+
+void inodeUnpin(int inodeNum)
+{
+    InodeCache::iterator it = inodeCache.find(inodeNum);
+    if (it != inodeCache.end() && it->second.pins > 0)
+    {
+        it->second.pins--;
+    }
+}
+
+//Hashes a name for the directory index (FNV-1a)
+unsigned int dxHash(const char* name)
+{
+    unsigned int hash = 2166136261u;
+    for (; *name != '\0'; name++)
+    {
+        hash = (hash ^ (unsigned char)*name) * 16777619u;
+    }
+    return hash;
+}
+
+//How many entries fit in one index block
+int dxCapacity()
+{
+    return (layout.sectorSize - sizeof(DxHeader)) / sizeof(DxEntry);
+}
+
+//Walks an indexed directory down from its root to the leaf a hash belongs in and returns its sector
+//(-1 if an index block can't be read or makes no sense). If path isn't NULL it gets the index blocks
+//on the way down, and slots which entry was followed in each, for an insert that splits them
+int dxFindLeaf(int rootSector, unsigned int hash, std::vector<int>* path, std::vector<int>* slots)
+{
+    int sector = rootSector;
+    for (int depth = 0; depth < DX_MAX_LEVELS; depth++)
+    {
+        const char* block = bufferGet(sector);
+        if (block == NULL)
+        {
+            return -1;
+        }
+        const DxHeader* header = (const DxHeader*)block;
+        const DxEntry* entries = (const DxEntry*)(block + sizeof(DxHeader));
+        if (header->count < 1 || header->count > dxCapacity())
+        {
+            return -1;
+        }
+
+        //binary search for the last entry whose hash isn't past ours
+        int low = 0;
+        int high = header->count - 1;
+        while (low < high)
+        {
+            int middle = (low + high + 1) / 2;
+            if (entries[middle].hash <= hash)
+            {
+                low = middle;
+            }
+            else
+            {
+                high = middle - 1;
+            }
+        }
+
+        if (path != NULL)
+        {
+            path->push_back(sector);
+            slots->push_back(low);
+        }
+        if (header->levels == 0)
+        {
+            return entries[low].sector;
+        }
+        sector = entries[low].sector;
+    }
+    return -1;
+}
+
+//Looks a name up in a directory, only going through its blocks if the answer isn't cached yet
+//Fills in what the name is (inodeNum -1 if nothing has it), or returns false if the directory
+//couldn't be read (which isn't remembered)
+bool dentryLookup(int directoryInodeNum, const std::string& name, Dentry* found)
+{
+    DentryKey key(directoryInodeNum, name);
+    DentryCache::iterator it = dentryCache.find(key);
+    if (it != dentryCache.end())
+    {
+        *found = it->second;
+        return true;
+    }
+
+    Inode* inode = inodeGet(directoryInodeNum);
+    if (inode == NULL)
+    {
+        return false;
+    }
+    Inode directory = *inode;
+
+    //an indexed directory has just the one leaf the name could be in, otherwise it's any of the blocks
+    int blocks[NUM_POINTERS];
+    int numBlocks = 0;
+    if (directory.fileType == 2)
+    {
+        blocks[numBlocks] = dxFindLeaf(directory.pointers[0], dxHash(name.c_str()), NULL, NULL);
+        if (blocks[numBlocks++] == -1)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        for (int i = 0; i < NUM_POINTERS; i++)
+        {
+            if (directory.pointers[i] != 0)
+            {
+                blocks[numBlocks++] = directory.pointers[i];
+            }
+        }
+    }
+
+    found->inodeNum = -1;
+    found->fileType = -1;
+    for (int i = 0; i < numBlocks && found->inodeNum == -1; i++)
+    {
+        const DirectoryEntry* block = (const DirectoryEntry*)bufferGet(blocks[i]);
+        if (block == NULL)
+        {
+            return false;
+        }
+        for (int j = 0; j < entriesPerBlock; j++)
+        {
+            if (strcmp(block[j].name, name.c_str()) == 0)
+            {
+                found->inodeNum = block[j].inodeNum;
+                break;
+            }
+        }
+    }
+
+    if (found->inodeNum != -1)
+    {
+        Inode* child = inodeGet(found->inodeNum);
+        if (child == NULL)
+        {
+            return false;
+        }
+        found->fileType = child->fileType;
+    }
+
+    if ((int)dentryCache.size() >= DENTRY_CACHE_ENTRIES)
+    {
+        dentryCache.clear();
+    }
+    dentryCache[key] = *found;
+    return true;
+}
+
+//Forgets what's cached for a name in a directory, whenever the name is added or taken away
+void dentryInvalidate(int directoryInodeNum, const std::string& name)
+{
+    dentryCache.erase(DentryKey(directoryInodeNum, name));
+}
+
+//FNV-1a, just to tell a whole record from a torn one
+unsigned int journalChecksum(const char* data, size_t length)
+{
+    unsigned int sum = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        sum = (sum ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return sum;
+}
+
+//How many home sectors one descriptor can list
+int journalCapacity()
+{
+    return (layout.sectorSize - sizeof(JournalBlock)) / sizeof(int);
+}
+
+//How many sectors the biggest record can hold: one descriptor's worth, as long as that fits in
+//the journal along with the header, a descriptor and a commit
+int journalRecordLimit()
+{
+    return std::min(journalCapacity(), layout.journalSectors - 3);
+}
+
+//Writes a journal header saying replay starts at the given record (in memory only)
+void journalWriteHeader(int sequence)
+{
+    std::vector<char> block(layout.sectorSize);
+    JournalBlock* header = (JournalBlock*)block.data();
+    strcpy(header->magic, "JHD");
+    header->sequence = sequence;
+    Disk_Write(layout.journalStart, block.data());
+}
+
+//Empties the journal by writing a new header (in memory only, the caller saves it)
+void journalReset(int sequence)
+{
+    journalPending.clear();
+    journalBefore.clear();
+    journalOps = 0;
+    journalNext = layout.journalStart + 1;
+    journalSequence = sequence;
+    if (layout.journalSectors == 0)
+    {
+        return;
+    }
+
+    journalWriteHeader(sequence);
+}
+
+int journalCheckpoint();
+
+//Waits for the background sync if there is one and tidies up after it. If nothing was committed
+//since its checkpoint the journal can be emptied; if it failed, it's done the slow way instead
+int syncFinish()
+{
+    if (syncCheckpoint == -1)
+    {
+        return 0;
+    }
+
+    int result = syncSave.get();
+    Disk_ReleaseCheckpoint(syncCheckpoint);
+    syncCheckpoint = -1;
+    if (result == -1)
+    {
+        return journalCheckpoint();
+    }
+
+    if (layout.journalSectors > 0 && journalNext == syncJournalNext)
+    {
+        //keeps whatever's pending for the next commit
+        journalNext = layout.journalStart + 1;
+        journalWriteHeader(journalSequence);
+        return Disk_SaveRange(bootPath, layout.journalStart, 1);
+    }
+    return 0;
+}
+
+//Discards the data sectors released since the last commit, once a commit or a save in place has made
+//their frees durable (before that, a crash would bring back metadata still pointing at them). One
+//that's been handed out again since is in use and stays
+void discardReleased()
+{
+    for (std::set<int>::iterator it = releasedSectors.begin(); it != releasedSectors.end(); it++)
+    {
+        int block = *it - layout.firstDataBlock;
+        if ((dataBitmap[block / 8] & (1 << (7 - block % 8))) == 0)
+        {
+            Disk_Discard(*it, 1);
+        }
+    }
+    releasedSectors.clear();
+}
+
+//Writes every changed sector to its home location in the image (durably) and only then empties the
+//journal. Safe to crash in as long as everything written in place is also in the journal
+int journalSaveHome()
+{
+    //only the sectors that changed since boot/last sync get rewritten
+    if (Disk_SaveIncremental(bootPath) == -1)
+    {
+        return -1;
+    }
+    discardReleased();
+
+    //everything's in place now, so the records so far can go
+    if (layout.journalSectors > 0)
+    {
+        journalReset(journalSequence);
+        return Disk_SaveRange(bootPath, layout.journalStart, 1);
+    }
+    return 0;
+}
+
+int journalCommit();
+
+//Puts everything in its home location in the image and empties the journal
+int journalCheckpoint()
+{
+    //a background sync would write its older copies over ours
+    if (syncFinish() == -1)
+    {
+        return -1;
+    }
+
+    if (layout.journalSectors > 0)
+    {
+        //commit first, so a crash halfway through the writes in place leaves whole operations to replay
+        if (journalCommit() == -1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        //the bitmaps and whatever's in the caches only live in memory until now
+        cacheFlush();
+        std::vector<Disk_IOVec> bitmaps = bitmapSectors();
+        if (Disk_WriteV(bitmaps.data(), bitmaps.size()) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return journalSaveHome();
+}
+
+//Makes room at the end of the journal for a record of count sectors. When there isn't enough,
+//the disk as of the last commit goes in place (the pending sectors are put back the way they were
+//for the length of the save) and the journal is emptied, keeping what's pending for the record
+int journalMakeRoom(int count)
+{
+    int end = layout.journalStart + layout.journalSectors;
+    if (journalNext + count + 2 <= end)
+    {
+        return 0;
+    }
+
+    //a background sync would write its older copies over ours (and may empty the journal itself)
+    if (syncFinish() == -1)
+    {
+        return -1;
+    }
+    if (journalNext + count + 2 <= end)
+    {
+        return 0;
+    }
+
+    //all of what's pending is read before any of it is put back, so a failed read changes nothing
+    std::vector<char> now((size_t)journalPending.size() * layout.sectorSize);
+    int i = 0;
+    for (std::set<int>::iterator it = journalPending.begin(); it != journalPending.end(); it++, i++)
+    {
+        if (Disk_Read(*it, &now[(size_t)i * layout.sectorSize]) == -1)
+        {
+            return -1;
+        }
+    }
+    int result = 0;
+    for (std::set<int>::iterator it = journalPending.begin(); it != journalPending.end() && result != -1; it++)
+    {
+        result = Disk_Write(*it, journalBefore[*it].data());
+    }
+    if (result != -1)
+    {
+        result = Disk_SaveIncremental(bootPath);
+    }
+    i = 0;
+    for (std::set<int>::iterator it = journalPending.begin(); it != journalPending.end(); it++, i++)
+    {
+        if (Disk_Write(*it, &now[(size_t)i * layout.sectorSize]) == -1)
+        {
+            result = -1;
+        }
+    }
+    if (result == -1)
+    {
+        return -1;
+    }
+
+    journalNext = layout.journalStart + 1;
+    journalWriteHeader(journalSequence);
+    return Disk_SaveRange(bootPath, layout.journalStart, 1);
+}
+
+//Appends every sector written since the last commit to the journal as one record, in one write
+int journalCommit()
+{
+    if (layout.journalSectors == 0)
+    {
+        return 0;
+    }
+
+    //the cached inodes and sectors that changed go to the disk first, so they're in the record
+    cacheFlush();
+
+    //pick up the bitmap sectors that changed
+    std::vector<Disk_IOVec> bitmaps = bitmapSectors();
+    std::vector<char> onDisk(layout.sectorSize);
+    for (size_t i = 0; i < bitmaps.size(); i++)
+    {
+        if (Disk_Read(bitmaps[i].sector, onDisk.data()) == -1)
+        {
+            return -1;
+        }
+        if (memcmp(onDisk.data(), bitmaps[i].buffer, layout.sectorSize) != 0 &&
+            writeSector(bitmaps[i].sector, bitmaps[i].buffer) == -1)
+        {
+            return -1;
+        }
+    }
+
+    int count = journalPending.size();
+    journalOps = 0;
+    if (count == 0)
+    {
+        //nothing changed on the disk, so whatever was released is as free there as it is here
+        discardReleased();
+        return 0;
+    }
+
+    //more than any record can hold (journalEndOp commits well before that, so only one operation
+    //bigger than the whole journal gets here): it can only go in place, unprotected
+    if (count > journalRecordLimit())
+    {
+        return journalSaveHome();
+    }
+    if (journalMakeRoom(count) == -1)
+    {
+        return -1;
+    }
+
+    //descriptor, the sectors themselves, then the commit; a sector that can't be read ends the
+    //commit before the checksum, so no record ever holds anything but what's on the disk
+    std::vector<char> record((size_t)(count + 2) * layout.sectorSize);
+    JournalBlock* descriptor = (JournalBlock*)record.data();
+    strcpy(descriptor->magic, "JDS");
+    descriptor->sequence = journalSequence;
+    descriptor->count = count;
+    int* homes = (int*)(record.data() + sizeof(JournalBlock));
+    int i = 0;
+    for (std::set<int>::iterator it = journalPending.begin(); it != journalPending.end(); it++, i++)
+    {
+        homes[i] = *it;
+        if (Disk_Read(*it, &record[(size_t)(i + 1) * layout.sectorSize]) == -1)
+        {
+            return -1;
+        }
+    }
+
+    JournalBlock* commit = (JournalBlock*)&record[(size_t)(count + 1) * layout.sectorSize];
+    strcpy(commit->magic, "JCM");
+    commit->sequence = journalSequence;
+    commit->count = count;
+    commit->checksum = journalChecksum(record.data(), (size_t)(count + 1) * layout.sectorSize);
+
+    if (Disk_WriteRange(journalNext, count + 2, record.data()) == -1 ||
+        Disk_SaveRange(bootPath, journalNext, count + 2) == -1)
+    {
+        return -1;
+    }
+
+    journalNext += count + 2;
+    journalSequence++;
+    journalPending.clear();
+    journalBefore.clear();
+    discardReleased();
+    return 0;
+}
+
+//About how many sectors the next commit would hold: the ones written since the last commit plus
+//whatever's only changed in the caches so far (every dirty inode counted as a sector of its own)
+int journalPendingSectors()
+{
+    int count = journalPending.size();
+    for (size_t i = 0; i < bufferSlots.size(); i++)
+    {
+        if (bufferSlots[i].dirty && journalPending.count(bufferSlots[i].sector) == 0)
+        {
+            count++;
+        }
+    }
+    for (InodeCache::iterator it = inodeCache.begin(); it != inodeCache.end(); ++it)
+    {
+        if (it->second.dirty)
+        {
+            count++;
+        }
+    }
+    return count;
+}
 
-//Maps from file descriptors to open file structs
-typedef std::unordered_map<int, OpenFile> OpenFileMap;
-OpenFileMap openFileTable;
+//Called at the end of every operation that changes the disk, commits once enough have piled up, or
+//once half a record's worth of sectors has (whatever journalGroupOps is), so a commit always fits
+void journalEndOp()
+{
+    if (layout.journalSectors == 0)
+    {
+        return;
+    }
 
-//bitmaps
-Bitmap* inodeBitmap;
-Bitmap* dataBitmap;
+    journalOps++;
+    if ((journalGroupOps > 0 && journalOps >= journalGroupOps) || journalPendingSectors() >= journalRecordLimit() / 2)
+    {
+        journalCommit();
+    }
+}
+
+//Reapplies every whole record left in the journal (from a crash before the next FS_Sync)
+//Returns how many there were, or -1 if the disk couldn't take them
+int journalReplay()
+{
+    if (layout.journalSectors == 0)
+    {
+        return 0;
+    }
+
+    std::vector<char> block(layout.sectorSize);
+    JournalBlock* header = (JournalBlock*)block.data();
+    if (Disk_Read(layout.journalStart, block.data()) == -1 || strcmp(header->magic, "JHD") != 0)
+    {
+        //never been used, start it off
+        journalReset(1);
+        return Disk_SaveRange(bootPath, layout.journalStart, 1);
+    }
+
+    int sequence = header->sequence;
+    int next = layout.journalStart + 1;
+    int end = layout.journalStart + layout.journalSectors;
+    int replayed = 0;
+    while (next + 2 <= end)
+    {
+        //stop at the first record that isn't the next one, or isn't all there
+        JournalBlock* descriptor = (JournalBlock*)block.data();
+        if (Disk_Read(next, block.data()) == -1 || strcmp(descriptor->magic, "JDS") != 0 ||
+            descriptor->sequence != sequence || descriptor->count <= 0 ||
+            descriptor->count > journalCapacity() || next + descriptor->count + 2 > end)
+        {
+            break;
+        }
+
+        int count = descriptor->count;
+        std::vector<char> record((size_t)(count + 2) * layout.sectorSize);
+        if (Disk_ReadRange(next, count + 2, record.data()) == -1)
+        {
+            break;
+        }
+        JournalBlock* commit = (JournalBlock*)&record[(size_t)(count + 1) * layout.sectorSize];
+        if (strcmp(commit->magic, "JCM") != 0 || commit->sequence != sequence || commit->count != count ||
+            commit->checksum != journalChecksum(record.data(), (size_t)(count + 1) * layout.sectorSize))
+        {
+            break;
+        }
+
+        int* homes = (int*)(record.data() + sizeof(JournalBlock));
+        for (int i = 0; i < count; i++)
+        {
+            if (Disk_Write(homes[i], &record[(size_t)(i + 1) * layout.sectorSize]) == -1)
+            {
+                return -1;
+            }
+        }
+
+        next += count + 2;
+        sequence++;
+        replayed++;
+    }
+
+    journalPending.clear();
+    journalBefore.clear();
+    journalOps = 0;
+    journalNext = next;
+    journalSequence = sequence;
+    return replayed;
+}
 
-//============ Helper Functions ============
 int
 Create_New_Disk(char* path)
 {
     int ok = 0;
 
     //prep the superblock
-    Superblock* super = (Superblock*)calloc(1, sizeof(Superblock));
-    strcpy(super->magic, magicString);
-    ok = Disk_Write(SUPER_BLOCK_OFFSET, (char*)super);
+    std::vector<char> super(layout.sectorSize);
+    memcpy(super.data(), &layout, sizeof(Superblock));
+    ok = Disk_Write(SUPER_BLOCK_OFFSET, super.data());
 
     if (ok == -1)
     {
@@ -79,14 +1083,7 @@ Create_New_Disk(char* path)
         return ok;
     }
     
-    //prep the bitma[s
-    inodeBitmap = (Bitmap*)calloc(1, sizeof(Bitmap));
-    dataBitmap = (Bitmap*)calloc(1, sizeof(Bitmap));
-
-    Disk_Write(INODE_BITMAP_OFFSET, (char*)inodeBitmap);
-    Disk_Write(DATA_BITMAP_OFFSET, (char*)dataBitmap);
-
-    //create the root directory
+    //create the root directory (useLayout already zeroed the bitmaps)
     ok = Dir_Create("/");
     if (ok == -1)
     {
@@ -94,6 +1091,17 @@ Create_New_Disk(char* path)
         return ok;
     }
 
+    //and an empty journal; the cached root and the bitmaps that now have it marked used go
+    //onto the disk too, so the save below has them all
+    journalReset(1);
+    cacheFlush();
+    std::vector<Disk_IOVec> bitmaps = bitmapSectors();
+    if (Disk_WriteV(bitmaps.data(), bitmaps.size()) == -1)
+    {
+        osErrno = E_CREATE;
+        return -1;
+    }
+
     ok = Disk_Save(path);
     if (ok == -1)
     {
@@ -104,57 +1112,493 @@ Create_New_Disk(char* path)
     return ok;
 }
 
-//Finds the first 0 in the inode bitmap
+//Sets up a fresh disk of the given geometry and writes an empty file system to path
+int formatDisk(char* path, int sectorSize, int numSectors)
+{
+    if (computeLayout(sectorSize, numSectors) == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    bootPath = path;
+
+    if (Disk_InitGeometry(sectorSize, numSectors) == -1)
+    {
+        printf("Disk_Init() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    useLayout();
+
+    //if mapping doesn't work out we just stay on the in-memory disk
+    if (mapDiskImage)
+    {
+        //whatever was in the file before must not show through
+        FILE* oldFile = fopen(path, "w");
+        if (oldFile != NULL)
+        {
+            fclose(oldFile);
+        }
+        if (Disk_Map(path, 0) == -1)
+        {
+            printf("Disk_Map() failed, loading the image instead\n");
+        }
+    }
+
+    return Create_New_Disk(path);
+}
+
+//Bitmaps are scanned 64 bits at a time. Bit n is 1 << (7 - n % 8) of byte n / 8 (highest bit first),
+//so a word is loaded big-endian to put bit 0 at the top and the first 0 is found by counting the
+//leading 1s. Where a scan starts is a policy, picked at compile time with -DFS_ALLOC_POLICY=...:
+//FirstFit always starts at bit 0 (the original behaviour), NextFit carries on from just past the
+//last bit handed out (the default, so allocating in a row doesn't rescan what's already full), and
+//GoalDirected starts just past a bit the caller names, e.g. the previous block of the same file
+struct FirstFit
+{
+    static int start(int, int) { return 0; }
+};
+
+struct NextFit
+{
+    static int start(int cursor, int) { return cursor; }
+};
+
+struct GoalDirected
+{
+    static int start(int cursor, int goal) { return goal >= 0 ? goal : cursor; }
+};
+
+#ifndef FS_ALLOC_POLICY
+#define FS_ALLOC_POLICY NextFit
+#endif
+typedef FS_ALLOC_POLICY AllocPolicy;
+
+//Bits 64 * word to 64 * word + 63 of a bitmap, the first one as the top bit
+//(bitmaps are whole sectors, so there's always a whole word to read)
+unsigned long long bitmapWord(const char* bitmap, int word)
+{
+    const unsigned char* bytes = (const unsigned char*)bitmap + word * 8;
+    unsigned long long value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+//How many 0s are above the highest 1 of a non-zero word
+int countLeadingZeros(unsigned long long word)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, word);
+    return 63 - (int)index;
+#else
+    return __builtin_clzll(word);
+#endif
+}
+
+//Finds the first 0 bit from "from" up to (not including) "to", or -1 if they're all 1s
+int bitmapFindFree(const char* bitmap, int from, int to)
+{
+    for (int word = from / 64; word * 64 < to; word++)
+    {
+        unsigned long long free = ~bitmapWord(bitmap, word);
+        if (word == from / 64)
+        {
+            free &= ~0ULL >> (from % 64); //not the bits before from
+        }
+        if (to - word * 64 < 64)
+        {
+            free &= ~(~0ULL >> (to - word * 64)); //or the ones from to on
+        }
+        if (free != 0)
+        {
+            return word * 64 + countLeadingZeros(free);
+        }
+    }
+    return -1;
+}
+
+//Sets the first 0 bit at or after where the policy says to start (going round to bit 0 if it has
+//to) and returns it, or -1 if the bitmap is full. The cursor moves to just past it
+template <class Policy>
+int bitmapAllocate(char* bitmap, int bits, int& cursor, int goal)
+{
+    int start = Policy::start(cursor, goal);
+    if (start < 0 || start >= bits)
+    {
+        start = 0;
+    }
+
+    int bit = bitmapFindFree(bitmap, start, bits);
+    if (bit == -1)
+    {
+        bit = bitmapFindFree(bitmap, 0, start);
+        if (bit == -1)
+        {
+            return -1;
+        }
+    }
+
+    bitmap[bit / 8] |= 1 << (7 - bit % 8);
+    cursor = bit + 1;
+    return bit;
+}
+
+//Finds a 0 in the inode bitmap (where depends on AllocPolicy) and marks it used
 //Returns the inode number, NOT the sector number! Must be adjusted by the caller before writing
 //This is because we need the actual inode number for pointers
 int findFirstAvailableInode()
 {
-    //Look through each char
-    for (int i = 0; i < NUM_CHARS; i++)
+    return bitmapAllocate<AllocPolicy>(inodeBitmap, layout.numInodes, inodeCursor, -1);
+}
+
+//Finds a 0 in the data bitmap and marks it used, as close after the goal sector as it can for
+//GoalDirected (-1 for no goal)
+//Returns the SECTOR number since data is considered in whole sectors rather than pieces
+int findFirstAvailableDataSector(int goal)
+{
+    int bit = bitmapAllocate<AllocPolicy>(dataBitmap, layout.numDataBlocks, dataCursor, goal == -1 ? -1 : goal - layout.firstDataBlock);
+    if (bit == -1)
     {
-        char c = inodeBitmap->bits[i];
-        //Each char represents 8 bits
-        for (int j = 7; j >= 0; j--) //check from highest to lowest bit, e.g. for 01111111 find on the first pass
+        return -1; //disk is full
+    }
+    return bit + layout.firstDataBlock;
+}
+
+//Gives back an inode that findFirstAvailableInode handed out
+void releaseInode(int inodeNum)
+{
+    inodeBitmap[inodeNum / 8] &= ~(1 << (7 - inodeNum % 8));
+}
+
+//Sets or clears a data sector's bit in the data bitmap
+void markDataSector(int sector, bool used)
+{
+    int block = sector - layout.firstDataBlock;
+    if (used)
+    {
+        dataBitmap[block / 8] |= 1 << (7 - block % 8);
+    }
+    else
+    {
+        dataBitmap[block / 8] &= ~(1 << (7 - block % 8));
+    }
+}
+
+//Gives back a data sector that findFirstAvailableDataSector handed out; it's discarded on the disk
+//(its memory and its space in the image file freed too) after the next commit, see discardReleased
+void releaseDataSector(int sector)
+{
+    markDataSector(sector, false);
+    bufferDrop(sector);
+    releasedSectors.insert(sector);
+}
+
+//Takes count free data sectors up front (near goal, see findFirstAvailableDataSector), so an operation
+//that may need several can give up before it changes anything; on a full disk the ones already taken
+//go back and it returns false
+bool takeDataSectors(int count, std::vector<int>& sectors, int goal)
+{
+    for (int i = 0; i < count; i++)
+    {
+        int sector = findFirstAvailableDataSector(sectors.empty() ? goal : sectors.back() + 1);
+        if (sector == -1)
         {
-            int comp = pow(2, j);
-            if ((c & comp) != comp) //theres a 0 at that position
+            for (size_t j = 0; j < sectors.size(); j++)
             {
-                //we want to flip the jth bit
-                c |= 1 << j; //this should do it: http://stackoverflow.com/questions/47981/how-do-you-set-clear-and-toggle-a-single-bit-in-c-c
-                inodeBitmap->bits[i] = c;
-
-                //now return the inode num
-                return ((i * 8) + abs(j - 7));
+                markDataSector(sectors[j], false);
             }
+            sectors.clear();
+            return false;
         }
+        sectors.push_back(sector);
     }
+    return true;
+}
 
-    return -1; //if we never find anything
+//Writes an index block holding the given entries
+void dxWriteIndex(int sector, int levels, const DxEntry* entries, int count)
+{
+    std::vector<char> block(layout.sectorSize, 0);
+    DxHeader* header = (DxHeader*)block.data();
+    header->count = count;
+    header->levels = levels;
+    memcpy(block.data() + sizeof(DxHeader), entries, count * sizeof(DxEntry));
+    bufferWrite(sector, block.data());
 }
 
-//Finds the first 0 in the data bitmap
-//Returns the SECTOR number since data is considered in whole sectors rather than pieces
-int findFirstAvailableDataSector()
+//Adds a name to an indexed directory, in the leaf its hash belongs in. A full leaf is split in two
+//(the new half gets an entry in the index block above), a full index block is split the same way,
+//and a full root moves down a level under a new root
+int dxInsert(int directoryInodeNum, const char* name, int newInodeNum)
+{
+    Inode* directory = inodeGet(directoryInodeNum);
+    if (directory == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    unsigned int hash = dxHash(name);
+    std::vector<int> path;
+    std::vector<int> slots;
+    int leaf = dxFindLeaf(directory->pointers[0], hash, &path, &slots);
+    if (leaf == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //copy out everything that might change, so nothing is touched until we know the insert goes through
+    std::vector<std::vector<DxEntry> > index(path.size());
+    std::vector<int> levels(path.size());
+    for (size_t i = 0; i < path.size(); i++)
+    {
+        const char* block = bufferGet(path[i]);
+        if (block == NULL)
+        {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        const DxHeader* header = (const DxHeader*)block;
+        const DxEntry* entries = (const DxEntry*)(block + sizeof(DxHeader));
+        index[i].assign(entries, entries + header->count);
+        levels[i] = header->levels;
+    }
+    const DirectoryEntry* leafBlock = (const DirectoryEntry*)bufferGet(leaf);
+    if (leafBlock == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    std::vector<DirectoryEntry> entries(leafBlock, leafBlock + entriesPerBlock);
+
+    DirectoryEntry newEntry;
+    memset(&newEntry, 0, sizeof(DirectoryEntry));
+    strcpy(newEntry.name, name);
+    newEntry.inodeNum = newInodeNum;
+
+    for (int j = 0; j < entriesPerBlock; j++)
+    {
+        if (entries[j].inodeNum == 0)
+        {
+            entries[j] = newEntry;
+            bufferWrite(leaf, (char*)entries.data());
+            return 0;
+        }
+    }
+
+    //the leaf is full: sort it (new name included) by hash and split it where the hash changes nearest
+    //the middle, so every hash still has one leaf
+    entries.push_back(newEntry);
+    std::vector<std::pair<unsigned int, int> > order;
+    for (size_t j = 0; j < entries.size(); j++)
+    {
+        order.push_back(std::make_pair(dxHash(entries[j].name), (int)j));
+    }
+    std::sort(order.begin(), order.end());
+
+    int count = order.size();
+    int middle = count / 2;
+    int split = -1;
+    for (int d = 0; split == -1 && (middle - d > 0 || middle + d < count); d++)
+    {
+        if (middle + d < count && order[middle + d - 1].first != order[middle + d].first)
+        {
+            split = middle + d;
+        }
+        else if (middle - d > 0 && order[middle - d - 1].first != order[middle - d].first)
+        {
+            split = middle - d;
+        }
+    }
+    if (split == -1)
+    {
+        //every name in the leaf has the same hash, there's nowhere to split it
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+
+    //one new sector for the leaf, one for each full index block above it, and one for a new root
+    int capacity = dxCapacity();
+    int needed = 1;
+    for (int depth = path.size() - 1; depth >= 0 && (int)index[depth].size() == capacity; depth--)
+    {
+        needed += (depth == 0) ? 2 : 1;
+    }
+    if (needed == (int)path.size() + 2 && (int)path.size() == DX_MAX_LEVELS)
+    {
+        //every level is full and the tree can't get any deeper
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+    std::vector<int> spare;
+    if (!takeDataSectors(needed, spare, leaf + 1))
+    {
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+    size_t nextSpare = 0;
+
+    std::vector<DirectoryEntry> lower(entriesPerBlock);
+    std::vector<DirectoryEntry> upper(entriesPerBlock);
+    for (int j = 0; j < count; j++)
+    {
+        if (j < split)
+        {
+            lower[j] = entries[order[j].second];
+        }
+        else
+        {
+            upper[j - split] = entries[order[j].second];
+        }
+    }
+    int newLeaf = spare[nextSpare++];
+    bufferWrite(leaf, (char*)lower.data());
+    bufferWrite(newLeaf, (char*)upper.data());
+
+    //now the index blocks above it, for as far up as they keep splitting
+    DxEntry child = { order[split].first, newLeaf };
+    for (int depth = path.size() - 1; depth >= 0; depth--)
+    {
+        std::vector<DxEntry>& list = index[depth];
+        list.insert(list.begin() + slots[depth] + 1, child);
+        if ((int)list.size() <= capacity)
+        {
+            dxWriteIndex(path[depth], levels[depth], list.data(), list.size());
+            break;
+        }
+
+        //the upper half moves to a new block at the same level
+        int half = list.size() / 2;
+        int newBlock = spare[nextSpare++];
+        dxWriteIndex(path[depth], levels[depth], list.data(), half);
+        dxWriteIndex(newBlock, levels[depth], list.data() + half, list.size() - half);
+        child.hash = list[half].hash;
+        child.sector = newBlock;
+
+        if (depth == 0)
+        {
+            //the root split, so a new one goes on top with the two halves under it
+            DxEntry halves[2] = { { 0, path[0] }, child };
+            int newRoot = spare[nextSpare++];
+            dxWriteIndex(newRoot, levels[0] + 1, halves, 2);
+
+            directory = inodeGet(directoryInodeNum);
+            directory->pointers[0] = newRoot;
+            inodeDirty(directoryInodeNum);
+        }
+    }
+    return 0;
+}
+
+//Turns a linear directory with every block full into an indexed one: its names are sorted by hash
+//into leaves left half empty (its old blocks, then new ones) under a single root index block
+int dxConvert(int directoryInodeNum)
 {
-    //Look through each char
-    for (int i = 0; i < NUM_CHARS; i++)
+    Inode* inode = inodeGet(directoryInodeNum);
+    if (inode == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    Inode directory = *inode;
+
+    std::vector<DirectoryEntry> entries;
+    std::vector<int> oldBlocks;
+    for (int i = 0; i < NUM_POINTERS; i++)
+    {
+        if (directory.pointers[i] == 0)
+        {
+            continue;
+        }
+        const DirectoryEntry* block = (const DirectoryEntry*)bufferGet(directory.pointers[i]);
+        if (block == NULL)
+        {
+            osErrno = E_GENERAL;
+            return -1;
+        }
+        for (int j = 0; j < entriesPerBlock; j++)
+        {
+            if (block[j].inodeNum != 0)
+            {
+                entries.push_back(block[j]);
+            }
+        }
+        oldBlocks.push_back(directory.pointers[i]);
+    }
+
+    std::vector<std::pair<unsigned int, int> > order;
+    for (size_t j = 0; j < entries.size(); j++)
+    {
+        order.push_back(std::make_pair(dxHash(entries[j].name), (int)j));
+    }
+    std::sort(order.begin(), order.end());
+
+    //half a block per leaf, except that a run of one hash can't be split between two
+    std::vector<int> leafStarts;
+    int count = order.size();
+    for (int start = 0; start < count; )
+    {
+        int end = std::min(start + entriesPerBlock / 2, count);
+        while (end < count && order[end].first == order[end - 1].first)
+        {
+            end++;
+        }
+        if (end - start > entriesPerBlock)
+        {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
+        leafStarts.push_back(start);
+        start = end;
+    }
+    leafStarts.push_back(count);
+
+    //no leaf holds more than a block did, so there are at least as many leaves as old blocks
+    int numLeaves = leafStarts.size() - 1;
+    if (numLeaves > dxCapacity())
+    {
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+    std::vector<int> sectors;
+    if (!takeDataSectors(numLeaves - (int)oldBlocks.size() + 1, sectors, oldBlocks.back() + 1))
+    {
+        osErrno = E_NO_SPACE;
+        return -1;
+    }
+    int rootSector = sectors.back();
+    sectors.pop_back();
+    sectors.insert(sectors.begin(), oldBlocks.begin(), oldBlocks.end());
+
+    std::vector<DxEntry> root;
+    for (int leaf = 0; leaf < numLeaves; leaf++)
     {
-        char c = dataBitmap->bits[i];
-        //Each char represents 8 bits
-        for (int j = 7; j >= 0; j--)
+        std::vector<DirectoryEntry> block(entriesPerBlock);
+        for (int j = leafStarts[leaf]; j < leafStarts[leaf + 1]; j++)
         {
-            int comp = pow(2, j);
-            if ((c & comp) != comp) //0 in that position
-            {
-                c |= 1 << j;
-                dataBitmap->bits[i] = c;
-
-                //return the sector number.
-                //still the same return function as above! here, each bit maps to an entire block
-                return ((i * 8) + abs(j - 7)) + FIRST_DATABLOCK_OFFSET;
-            }
+            block[j - leafStarts[leaf]] = entries[order[j].second];
         }
+        bufferWrite(sectors[leaf], (char*)block.data());
+
+        DxEntry entry = { leaf == 0 ? 0 : order[leafStarts[leaf]].first, sectors[leaf] };
+        root.push_back(entry);
+    }
+    dxWriteIndex(rootSector, 0, root.data(), root.size());
+
+    inode = inodeGet(directoryInodeNum);
+    inode->fileType = 2;
+    for (int i = 0; i < NUM_POINTERS; i++)
+    {
+        inode->pointers[i] = 0;
     }
+    inode->pointers[0] = rootSector;
+    inodeDirty(directoryInodeNum);
+    return 0;
 }
 
 //Recursively searches the given inode for the current pathsegment
@@ -169,49 +1613,31 @@ int searchInodeForPath(int inodeToSearch, std::vector<std::string>& path, int pa
         return inodeToSearch;
     }
 
-    //First, load the current directory inode
-    Inode* inodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    int inodeSector = (inodeToSearch / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-    Disk_Read(inodeSector, (char*)inodeBlock);
-    Inode curNode = inodeBlock[inodeToSearch % NUM_INODES_PER_BLOCK]; //mod to get the actual inode
+    //Look the current path segment up in the current directory (usually straight from the dentry cache)
+    Dentry child;
+    if (!dentryLookup(inodeToSearch, path.at(pathSegment), &child))
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
-    //Search the contents of the current inode
-    int i = 0;
-    while (curNode.pointers[i] != 0)
+    if (child.inodeNum == -1)
     {
-        DirectoryEntry* directoryBlock = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry));
-        Disk_Read(curNode.pointers[i], (char*)directoryBlock);
-        for (int j = 0; j < NUM_DIRECTORIES_PER_BLOCK; j++)
-        {
-            DirectoryEntry curEntry = directoryBlock[j];
-            std::string name(curEntry.name);
-            if (name.compare(path.at(pathSegment)) == 0)
-            {
-                //we found something with the same name! but:
-                //we have to check and make sure this is actually a directory
-                //do this by loading the inode
-                Inode* innerNodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-                int innerInodeSector = (curEntry.inodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-                Disk_Read(innerInodeSector, (char*)innerNodeBlock);
-                Inode innerCurNode = innerNodeBlock[curEntry.inodeNum % NUM_INODES_PER_BLOCK];
-                if (innerCurNode.fileType == 0)
-                {
-                    //if it's a file, it can't be a directory. we've been supplied with a bogus path like "/dir1/one.txt/dir2"
-                    osErrno = E_NO_SUCH_FILE;
-                    return -1;
-                }
+        //we get here if we never find the current path segment
+        osErrno = E_NO_SUCH_FILE; //guess
+        return -1;
+    }
 
-                //if it is a directory and it's got the same name, recurse and search it!
-                return searchInodeForPath(curEntry.inodeNum, path, pathSegment + 1);
-            }
-            //else continue
-        }
-        i++;
+    //we found something with the same name! but it has to be a directory
+    if (child.fileType == 0)
+    {
+        //if it's a file, it can't be a directory. we've been supplied with a bogus path like "/dir1/one.txt/dir2"
+        osErrno = E_NO_SUCH_FILE;
+        return -1;
     }
 
-    //we get here if we never find the current path segment
-    osErrno = E_NO_SUCH_FILE; //guess
-    return -1;
+    //if it is a directory and it's got the same name, recurse and search it!
+    return searchInodeForPath(child.inodeNum, path, pathSegment + 1);
 }
 
 std::vector<std::string> tokenizePathToVector(std::string pathStr)
@@ -237,49 +1663,67 @@ std::vector<std::string> tokenizePathToVector(std::string pathStr)
 
 int insertDirectoryEntry(std::vector<std::string>& pathVec, int parentInodeNum, int newInodeNum)
 {
-    Inode* parentInodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    int parentInodeSector = (parentInodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-    Disk_Read(parentInodeSector, (char*)parentInodeBlock);
+    Inode* parentInode = inodeGet(parentInodeNum);
+    if (parentInode == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
     //Now, insert a directoryentry for c into the directory block pointed to by b's inode
     bool inserted = false;
     int i = 0;
     while (!inserted) //check the parent inodes pointers
     {
-        if (i == NUM_POINTERS)
+        if (i == NUM_POINTERS || parentInode->fileType == 2)
         {
-            //checked all pointers and not inserted anything
-            //means we never found a 0 in the directory entry for any of the pointers (very unlikely)
-
-            osErrno = E_GENERAL;
-            return -1;
+            //checked all pointers and not inserted anything, so the directory is full: it switches to a
+            //hash index (if it hasn't already) and the index finds the entry a place
+            if (parentInode->fileType != 2 && dxConvert(parentInodeNum) == -1)
+            {
+                return -1;
+            }
+            if (dxInsert(parentInodeNum, pathVec.at(pathVec.size() - 1).c_str(), newInodeNum) == -1)
+            {
+                return -1;
+            }
+            break;
         }
 
-        int entrySector = parentInodeBlock[parentInodeNum % NUM_INODES_PER_BLOCK].pointers[i];
+        int entrySector = parentInode->pointers[i];
         if (entrySector == 0)
         {
             //if we've hit a pointer to 0, we need a new Directory sector and everything. find a new one with the bitmap and create it normally.
-            DirectoryEntry* newEntry = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry));
+            int newDirectorySector = findFirstAvailableDataSector(i > 0 ? parentInode->pointers[i - 1] + 1 : -1);
+            if (newDirectorySector == -1)
+            {
+                osErrno = E_NO_SPACE;
+                return -1;
+            }
+            DirectoryEntry* newEntry = (DirectoryEntry*)calloc(entriesPerBlock, sizeof(DirectoryEntry));
             newEntry[0].inodeNum = newInodeNum;
             strcpy(newEntry[0].name, pathVec.at(pathVec.size() - 1).c_str());
-            int newDirectorySector = findFirstAvailableDataSector();
-            Disk_Write(newDirectorySector, (char*)newEntry);
-            parentInodeBlock[parentInodeNum % NUM_INODES_PER_BLOCK].pointers[i] = newDirectorySector;
+            bufferWrite(newDirectorySector, (char*)newEntry);
+            free(newEntry);
+
+            //the parent inode has to remember the new block too
+            parentInode->pointers[i] = newDirectorySector;
+            inodeDirty(parentInodeNum);
 
             inserted = true;
             break;
         }
 
-        DirectoryEntry* entryBlock = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry));
-        Disk_Read(entrySector, (char*)entryBlock);
+        //look for a free slot in the cached block and fill it in there
+        DirectoryEntry* entryBlock = (DirectoryEntry*)bufferGet(entrySector);
 
-        for (int j = 0; j < NUM_DIRECTORIES_PER_BLOCK; j++)
+        for (int j = 0; entryBlock != NULL && j < entriesPerBlock; j++)
         {
             if (entryBlock[j].inodeNum == 0) //can't possibly be the superblock! calloc should set it to 0 initially
             {
                 strcpy(entryBlock[j].name, pathVec.at(pathVec.size() - 1).c_str()); //copy the end of the path name into the new entry
                 entryBlock[j].inodeNum = newInodeNum;
-                Disk_Write(entrySector, (char*)entryBlock); //update the entry
+                bufferDirty(entrySector); //update the entry
                 inserted = true;
                 break;
             }
@@ -288,97 +1732,353 @@ int insertDirectoryEntry(std::vector<std::string>& pathVec, int parentInodeNum,
         i++;
     }
 
+    //whatever was cached for the name (most likely that it wasn't there) is out of date now
+    dentryInvalidate(parentInodeNum, pathVec.at(pathVec.size() - 1));
     return 0;
 }
 
 bool directoryContainsName(int directoryInodeNum, std::string name)
 {
-    //load the inode
-    Inode* nodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    int inodeSector = directoryInodeNum / NUM_INODES_PER_BLOCK + ROOT_INODE_OFFSET;
-    Disk_Read(inodeSector, (char*)nodeBlock);
-    Inode curNode = nodeBlock[directoryInodeNum % NUM_INODES_PER_BLOCK];
+    Dentry found;
+    return dentryLookup(directoryInodeNum, name, &found) && found.inodeNum != -1;
+}
 
-    for (int i = 0; i < NUM_POINTERS; i++)
+//============ API Functions ===============
+int FS_Boot(char *path)
+{
+    printf("FS_Boot %s\n", path);
+
+    //don't pull the disk out from under a background sync
+    syncFinish();
+
+    //check if we need to create a new file, or open an existing one
+    FILE* openFile = fopen(path, "r");
+    if (openFile == NULL) //unable to open, create new file
     {
-        if (curNode.pointers[i] != 0)
-        {
-            //load the block at that pointer
-            DirectoryEntry* dirBlock = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry));
-            Disk_Read(curNode.pointers[i], (char*)dirBlock);
+        return formatDisk(path, SECTOR_SIZE, NUM_SECTORS);
+    }
 
-            for (int j = 0; j < NUM_DIRECTORIES_PER_BLOCK; j++)
-            {
-                DirectoryEntry curEntry = dirBlock[j];
-                std::string tempName(curEntry.name);
-                if (tempName.compare(name) == 0)
-                {
-                    return true;
-                }
-            }
+    //the superblock says how big the disk is, so peek at it before setting the disk up
+    Superblock super;
+    memset(&super, 0, sizeof(Superblock));
+    fread(&super, 1, sizeof(Superblock), openFile);
+    fclose(openFile);
+    super.magic[3] = '\0';
+    if (strcmp(super.magic, magicString) != 0)
+    {
+        printf("Superblock magic number validation failed");
+        std::cout << "Actually found " << super.magic << std::endl;
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    if (super.sectorSize == 0) //made before the geometry was recorded, so it's the default one
+    {
+        computeLayout(SECTOR_SIZE, NUM_SECTORS);
+
+        //and from before the journal too, so the end of the disk is all data
+        layout.numDataBlocks += layout.journalSectors;
+        layout.journalStart = 0;
+        layout.journalSectors = 0;
+    }
+    else
+    {
+        layout = super;
+    }
+    bootPath = path;
+
+    if (Disk_InitGeometry(layout.sectorSize, layout.numSectors) == -1)
+    {
+        printf("Disk_Init() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    useLayout();
+
+    //if mapping doesn't work out we just stay on the in-memory disk
+    if (mapDiskImage && Disk_Map(path, 0) == -1)
+    {
+        printf("Disk_Map() failed, loading the image instead\n");
+    }
+
+    //load the existing file
+    if (Disk_Load(path) == -1)
+    {
+        printf("Disk_Load() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //finish off whatever was committed but never synced (the bitmaps are in there too)
+    int replayed = journalReplay();
+    if (replayed == -1)
+    {
+        printf("journalReplay() failed\n");
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    std::vector<Disk_IOVec> bitmaps = bitmapSectors();
+    Disk_ReadV(bitmaps.data(), bitmaps.size());
+
+    if (replayed > 0)
+    {
+        printf("Replayed %d journal records\n", replayed);
+        if (journalCheckpoint() == -1)
+        {
+            osErrno = E_GENERAL;
+            return -1;
         }
     }
 
-    return false; //if we never find it
+    return 0;
 }
 
-//============ API Functions ===============
-int FS_Boot(char *path)
+int FS_Format(char *path, int sectorSize, int numSectors)
 {
-    printf("FS_Boot %s\n", path);
-    bootPath = path;
+    printf("FS_Format %s (%d x %d)\n", path, numSectors, sectorSize);
+    return formatDisk(path, sectorSize, numSectors);
+}
+
+int FS_Sync()
+{
+    printf("FS_Sync\n");
 
-    if (Disk_Init() == -1)
+    //update the disk with the current structures, and empty the journal
+    if (journalCheckpoint() == -1)
     {
-        printf("Disk_Init() failed\n");
         osErrno = E_GENERAL;
         return -1;
     }
 
-    //check if we need to create a new file, or open an existing one
-    FILE* openFile = fopen(path, "r");
-    if (openFile == NULL) //unable to open, create new file
+    return 0;
+}
+
+//Starts a sync that carries on in the background while the file system is used; returns a handle for FS_SyncWait
+int FS_SyncAsync()
+{
+    printf("FS_SyncAsync\n");
+
+    //one at a time
+    if (syncFinish() == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //commit everything first, so the journal covers what's being written home until it's all there
+    if (layout.journalSectors > 0)
     {
-        return Create_New_Disk(path);
+        if (journalCommit() == -1)
+        {
+            osErrno = E_GENERAL;
+            return -1;
+        }
     }
-    else //load the existing file
+    else
     {
-        Disk_Load(path);
+        cacheFlush();
+        std::vector<Disk_IOVec> bitmaps = bitmapSectors();
+        Disk_WriteV(bitmaps.data(), bitmaps.size());
+    }
 
-        //check that size is correct and superblock accurate per section 3.5
-        Superblock* super = (Superblock*)calloc(1, sizeof(Superblock));
-        Disk_Read(SUPER_BLOCK_OFFSET, (char*)super);
-        if (strcmp(super->magic, magicString) != 0)
+    //freeze the disk as it is now and write that out from another thread (the journal itself
+    //is kept up to date by the commits, so it's left out). A mapped image, or a disk that
+    //can't take a checkpoint, just gets a normal sync
+    int checkpoint = mapDiskImage ? -1 : Disk_Checkpoint();
+    if (checkpoint == -1)
+    {
+        if (journalCheckpoint() == -1)
         {
-            printf("Superblock magic number validation failed");
-            std::cout << "Actually found " << super->magic << std::endl;
             osErrno = E_GENERAL;
             return -1;
         }
+        return ++syncHandle;
+    }
+    int homeSectors = layout.journalSectors > 0 ? layout.journalStart : layout.numSectors;
+    char* path = bootPath;
+    syncCheckpoint = checkpoint;
+    syncJournalNext = journalNext;
+    syncSave = std::async(std::launch::async, [path, checkpoint, homeSectors]()
+    {
+        return Disk_SaveCheckpoint(path, checkpoint, 0, homeSectors);
+    });
+    return ++syncHandle;
+}
+
+//Waits until the sync with the given handle (and every one before it) is on disk
+int FS_SyncWait(int handle)
+{
+    printf("FS_SyncWait\n");
 
-        inodeBitmap = (Bitmap*)calloc(1, sizeof(Bitmap));
-        dataBitmap = (Bitmap*)calloc(1, sizeof(Bitmap));
+    if (handle <= 0 || handle > syncHandle)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
-        Disk_Read(INODE_BITMAP_OFFSET, (char*)inodeBitmap);
-        Disk_Read(DATA_BITMAP_OFFSET, (char*)dataBitmap);
+    //older ones were finished off before the newest one started
+    if (handle == syncHandle && syncFinish() == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
     }
 
     return 0;
 }
 
-int FS_Sync()
+//Makes everything done so far durable with one append to the journal, without a full sync
+int FS_Commit()
 {
-    printf("FS_Sync\n");
+    printf("FS_Commit\n");
+
+    if (journalCommit() == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+//Flushes the buffer cache and gives it room for the given number of sectors
+int FS_SetCacheSize(int sectors)
+{
+    if (sectors <= 0)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
-    //update the disk with the current structures:
-    Disk_Write(INODE_BITMAP_OFFSET, (char*)inodeBitmap);
-    Disk_Write(DATA_BITMAP_OFFSET, (char*)dataBitmap);
+    cacheFlush();
+    bufferCapacity = sectors;
+    bufferReset();
+    return 0;
+}
 
-    Disk_Save(bootPath);
+int FS_GetCacheStats(FS_CacheStats* stats)
+{
+    if (stats == NULL)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
 
+    *stats = bufferStats;
     return 0;
 }
 
+//Grows the disk to numSectors without moving anything on it: the new sectors (and the old journal,
+//which moves to the new end) become data blocks, the data bitmap takes the extra sectors it needs
+//from the start of the new space, and the new superblock goes out with a sync
+int FS_Grow(int numSectors)
+{
+    printf("FS_Grow %d\n", numSectors);
+
+    if (numSectors <= layout.numSectors)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //everything goes home first, so nothing is left in the old journal
+    if (journalCheckpoint() == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    Superblock grown = layout;
+    grown.numSectors = numSectors;
+    if (layout.journalSectors > 0)
+    {
+        grown.journalSectors = journalSize(numSectors);
+        grown.journalStart = numSectors - grown.journalSectors;
+    }
+    int oldEnd = layout.firstDataBlock + layout.numDataBlocks;
+    int newEnd = layout.journalSectors > 0 ? grown.journalStart : numSectors;
+    grown.numDataBlocks = newEnd - layout.firstDataBlock;
+
+    //the bitmap sectors in front of the inode table can't grow, so the rest of the bitmap lives in
+    //the data blocks; it moves to the new space whenever it needs more sectors
+    int bitsPerSector = layout.sectorSize * 8;
+    int moreBits = grown.numDataBlocks - layout.dataBitmapSectors * bitsPerSector;
+    int moreSectors = moreBits > 0 ? (moreBits + bitsPerSector - 1) / bitsPerSector : 0;
+    if (moreSectors != layout.dataBitmapMoreSectors)
+    {
+        if (oldEnd + moreSectors > newEnd)
+        {
+            osErrno = E_NO_SPACE;
+            return -1;
+        }
+        grown.dataBitmapMoreStart = oldEnd;
+        grown.dataBitmapMoreSectors = moreSectors;
+    }
+
+    if (Disk_Grow(numSectors) == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //the new superblock, and the old journal is free space now; if either can't be done the file
+    //system stays as it was (the old superblock and journal header go back, the extra sectors just
+    //go unused)
+    std::vector<char> super(layout.sectorSize);
+    memcpy(super.data(), &grown, sizeof(Superblock));
+    if (Disk_Write(SUPER_BLOCK_OFFSET, super.data()) == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    if (layout.journalSectors > 0 && Disk_Discard(layout.journalStart, layout.journalSectors) == -1)
+    {
+        memcpy(super.data(), &layout, sizeof(Superblock));
+        Disk_Write(SUPER_BLOCK_OFFSET, super.data());
+        journalWriteHeader(journalSequence);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    //the bitmap grows with the new blocks free, apart from the ones holding it
+    char* bitmap = (char*)calloc(grown.dataBitmapSectors + grown.dataBitmapMoreSectors, grown.sectorSize);
+    if (bitmap == NULL)
+    {
+        memcpy(super.data(), &layout, sizeof(Superblock));
+        Disk_Write(SUPER_BLOCK_OFFSET, super.data());
+        journalWriteHeader(journalSequence);
+        osErrno = E_GENERAL;
+        return -1;
+    }
+    int oldBitmapBytes = (layout.dataBitmapSectors + layout.dataBitmapMoreSectors) * layout.sectorSize;
+    int oldMoreStart = layout.dataBitmapMoreStart;
+    int oldMoreSectors = layout.dataBitmapMoreSectors;
+    layout = grown;
+    memcpy(bitmap, dataBitmap, oldBitmapBytes);
+    free(dataBitmap);
+    dataBitmap = bitmap;
+    if (layout.dataBitmapMoreStart != oldMoreStart)
+    {
+        for (int i = 0; i < oldMoreSectors; i++)
+        {
+            markDataSector(oldMoreStart + i, false);
+        }
+        for (int i = 0; i < layout.dataBitmapMoreSectors; i++)
+        {
+            markDataSector(layout.dataBitmapMoreStart + i, true);
+        }
+    }
+
+    //an empty journal at the new end, then all of it out to the image
+    journalReset(journalSequence);
+    if (journalCheckpoint() == -1)
+    {
+        osErrno = E_GENERAL;
+        return -1;
+    }
+
+    return 0;
+}
 
 int File_Create(char *file)
 {
@@ -388,29 +2088,46 @@ int File_Create(char *file)
     std::vector <std::string> pathVec = tokenizePathToVector(pathStr);
 
     int newInodeNum = findFirstAvailableInode();
-    int newInodeSector = newInodeNum / NUM_INODES_PER_BLOCK + ROOT_INODE_OFFSET;
+    if (newInodeNum == -1)
+    {
+        osErrno = E_CREATE;
+        return -1;
+    }
 
     int parentInodeNum = searchInodeForPath(0, pathVec, 0);
+    if (parentInodeNum == -1)
+    {
+        releaseInode(newInodeNum);
+        osErrno = E_CREATE;
+        return -1;
+    }
+
     //before we add a directory entry, make sure a file with this name does not already exist in the parent
     bool alreadyExists = directoryContainsName(parentInodeNum, pathVec.at(pathVec.size() - 1));
     if (alreadyExists)
     {
+        releaseInode(newInodeNum);
         osErrno = E_CREATE;
         return -1;
     }
 
-    insertDirectoryEntry(pathVec, parentInodeNum, newInodeNum);
+    if (insertDirectoryEntry(pathVec, parentInodeNum, newInodeNum) == -1)
+    {
+        releaseInode(newInodeNum);
+        osErrno = E_CREATE;
+        return -1;
+    }
 
     //now create the new inode for the file
-    Inode* newNodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    Disk_Read(newInodeSector, (char*)newNodeBlock);
-    newNodeBlock[newInodeNum % NUM_INODES_PER_BLOCK].fileType = 0;
-    newNodeBlock[newInodeNum % NUM_INODES_PER_BLOCK].fileSize = 0;
+    Inode* newNode = inodeGet(newInodeNum);
+    newNode->fileType = 0;
+    newNode->fileSize = 0;
     //that's it, I think! No need to point to anything since they've not tried to write yet
 
-    Disk_Write(newInodeSector, (char*)newNodeBlock);
+    inodeDirty(newInodeNum);
 
     totalFilesAndDirectories++;
+    journalEndOp();
     return 0;
 }
 
@@ -431,12 +2148,8 @@ int File_Open(char *file)
         return -1;
     }
 
-    Inode* parentInodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    int inodeSector = (parentInodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-    Disk_Read(inodeSector, (char*)parentInodeBlock);
-    Inode parentInode = parentInodeBlock[parentInodeNum % NUM_INODES_PER_BLOCK];
-
-    if (parentInode.fileType != 1) //if not a directory
+    Inode* parentNode = inodeGet(parentInodeNum);
+    if (parentNode == NULL || parentNode->fileType == 0) //if not a directory
     {
         osErrno = E_NO_SUCH_FILE;
         return -1;
@@ -448,37 +2161,31 @@ int File_Open(char *file)
         return -1;
     }
 
-    //Now that we have the parent inode, search the contents of its directory
-    //for the file we're trying to open
-    for (int i = 0; i < NUM_POINTERS; i++) //go through all the pointers
+    //Now that we have the parent inode, look for the file we're trying to open in its directory
+    Dentry found;
+    if (dentryLookup(parentInodeNum, pathVec.at(pathVec.size() - 1), &found) && found.inodeNum != -1)
     {
-        DirectoryEntry* dirBlock = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry));
-        Disk_Read(parentInode.pointers[i], (char*)dirBlock);
-        for (int j = 0; j < NUM_DIRECTORIES_PER_BLOCK; j++) //go through all the directories for the given pointer
+        //we need the size of the file
+        Inode* curNode = inodeGet(found.inodeNum);
+        if (curNode == NULL)
         {
-            DirectoryEntry curEntry = dirBlock[j];
-            if (strcmp(curEntry.name, pathVec.at(pathVec.size() - 1).c_str()) == 0) //if we find the file, open it!
-            {
-                //we need the size of the file
-                //grab that inodenum
-                Inode* nodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-                int inodeSector = (curEntry.inodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-                Disk_Read(inodeSector, (char*)nodeBlock);
-                Inode curNode = nodeBlock[curEntry.inodeNum % NUM_INODES_PER_BLOCK];
-
-                OpenFile of;
-                of.filepointer = curNode.fileSize;
-                of.inodeNum = curEntry.inodeNum;
-                openFileTable.insert(std::pair<int, OpenFile>(fileDescriptorCount, of));
-                fileDescriptorCount++; //increase for uniqueness, BUT:
-                return (fileDescriptorCount - 1); //return the one we saved!
-
-                //TODO: again, note that this returns the inode for anything with the right name
-                //this could be opening a directory, i think
-            }
+            osErrno = E_GENERAL;
+            return -1;
         }
-    }
 
+        //it stays cached until the fd is closed
+        inodePin(found.inodeNum);
+
+        OpenFile of;
+        of.filepointer = curNode->fileSize;
+        of.inodeNum = found.inodeNum;
+        openFileTable.insert(std::pair<int, OpenFile>(fileDescriptorCount, of));
+        fileDescriptorCount++; //increase for uniqueness, BUT:
+        return (fileDescriptorCount - 1); //return the one we saved!
+
+        //TODO: again, note that this returns the inode for anything with the right name
+        //this could be opening a directory, i think
+    }
     return 0;
 }
 
@@ -494,16 +2201,15 @@ int File_Write(int fd, void *buffer, int size)
     }
 
     OpenFile open = openFileTable.at(fd);
-    //get the inode of the file
-    Inode* inodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    int inodeSector = (open.inodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-    Disk_Read(inodeSector, (char*)inodeBlock);
-    Inode curNode = inodeBlock[open.inodeNum % NUM_INODES_PER_BLOCK];
+    //get the inode of the file (pinned in the cache since it was opened), and change a copy
+    //of it so nothing changes if we run out of space part way
+    Inode* inode = inodeGet(open.inodeNum);
+    Inode curNode = *inode;
 
     int filePointer = open.filepointer;
     
     //if the write completes, the size will be the curSize (filepointer) + size
-    if (filePointer + size > NUM_POINTERS * SECTOR_SIZE)
+    if (filePointer + size > NUM_POINTERS * layout.sectorSize)
     {
         osErrno = E_FILE_TOO_BIG;
         return -1;
@@ -511,41 +2217,59 @@ int File_Write(int fd, void *buffer, int size)
 
     int bufferOffset = 0;
     int remainingSize = size;
+
+    //stage every touched block, then write them all in one call
+    int blockCount = (filePointer % layout.sectorSize + size + layout.sectorSize - 1) / layout.sectorSize;
+    std::vector<char> writeBlocks((size_t)blockCount * layout.sectorSize);
+    std::vector<Disk_IOVec> writes;
+    std::vector<int> newSectors; //given back if the disk fills up part way
     while (remainingSize > 0)
     {
-        int filePointerForBlock = filePointer % SECTOR_SIZE;
-        FileData* writeBlock = new FileData();
+        int filePointerForBlock = filePointer % layout.sectorSize;
+        char* writeBlock = &writeBlocks[writes.size() * layout.sectorSize];
         int dataSector;
 
         if (filePointerForBlock == 0) //at the beginning, create a new one
         {
-            dataSector = findFirstAvailableDataSector();
-            inodeBlock[open.inodeNum % NUM_INODES_PER_BLOCK].pointers[filePointer / SECTOR_SIZE] = dataSector;
-            Disk_Write(inodeSector, (char*)inodeBlock);
+            int block = filePointer / layout.sectorSize;
+            dataSector = findFirstAvailableDataSector(block > 0 ? curNode.pointers[block - 1] + 1 : -1); //right after the one before, if it can
+            if (dataSector == -1)
+            {
+                for (size_t i = 0; i < newSectors.size(); i++)
+                {
+                    releaseDataSector(newSectors[i]);
+                }
+                osErrno = E_NO_SPACE;
+                return -1;
+            }
+            newSectors.push_back(dataSector);
+            curNode.pointers[filePointer / layout.sectorSize] = dataSector; //goes out with the size update below
         }
         else
         {
-            dataSector = curNode.pointers[filePointer / SECTOR_SIZE];
-            Disk_Read(dataSector, (char*)writeBlock);
+            dataSector = curNode.pointers[filePointer / layout.sectorSize];
+            Disk_Read(dataSector, writeBlock);
         }
 
         int remainingSizeBackup = remainingSize;
-        for (int i = filePointerForBlock; filePointerForBlock < SECTOR_SIZE; i++, bufferOffset++, filePointerForBlock++, filePointer++, remainingSize--)
+        for (int i = filePointerForBlock; filePointerForBlock < layout.sectorSize; i++, bufferOffset++, filePointerForBlock++, filePointer++, remainingSize--)
         {
             if (remainingSize == 0)
             {
                 break;
             }
-            writeBlock->contents[i] = ((char*)buffer)[bufferOffset];
+            writeBlock[i] = ((char*)buffer)[bufferOffset];
         }
 
-        Disk_Write(dataSector, (char*)writeBlock);
-        //filePointer++;
+        Disk_IOVec write = { dataSector, writeBlock };
+        writes.push_back(write);
     }
+    writeSectors(writes);
 
     //update the files inode
-    inodeBlock[open.inodeNum % NUM_INODES_PER_BLOCK].fileSize += size;
-    Disk_Write(inodeSector, (char*)inodeBlock);
+    curNode.fileSize += size;
+    *inode = curNode;
+    inodeDirty(open.inodeNum);
 
     //update the open file table with the new filepointer
     //we know we found that value so we can use the iterator per http://stackoverflow.com/questions/16291897/in-unordered-map-of-c11-how-to-update-the-value-of-a-particular-key
@@ -554,7 +2278,8 @@ int File_Write(int fd, void *buffer, int size)
     newOf.filepointer = filePointer;
     it->second = newOf;
 
-    return inodeBlock[open.inodeNum % NUM_INODES_PER_BLOCK].fileSize;
+    journalEndOp();
+    return curNode.fileSize;
 }
 
 int File_Close(int fd)
@@ -570,6 +2295,7 @@ int File_Close(int fd)
     }
 
     //if we found it, close the file and get out of here
+    inodeUnpin(it->second.inodeNum);
     openFileTable.erase(fd);
     return 0;
 }
@@ -582,39 +2308,48 @@ int Dir_Create(char *path)
     std::string pathStr(path);
     std::vector<std::string> pathVec = tokenizePathToVector(pathStr);
 
-    //create the inode
-    Inode* inodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode)); //allocate a block full of inodes
-
     //create the actual directory
-    DirectoryEntry* directoryBlock = (DirectoryEntry*)calloc(NUM_DIRECTORIES_PER_BLOCK, sizeof(DirectoryEntry)); //allocate a block full of entries, all bits are 0
+    DirectoryEntry* directoryBlock = (DirectoryEntry*)calloc(entriesPerBlock, sizeof(DirectoryEntry)); //allocate a block full of entries, all bits are 0
     int directorySector = findFirstAvailableDataSector(); //note that this does not have to be floor divided, it returns the SECTOR
+    if (directorySector == -1)
+    {
+        free(directoryBlock);
+        osErrno = E_CREATE;
+        return -1;
+    }
 
     //special case--first directory
     if (pathStr.compare("/") == 0)
     {
         //there's nothing in the directory, so leave it as all 0's
 
-        inodeBlock[0].fileType = 1; //directory
-        inodeBlock[0].fileSize = 0; //nothing in it
-        inodeBlock[0].pointers[0] = directorySector;
-
         findFirstAvailableInode(); //we don't need the value here (should be 0), but we need to flip that bit so we don't overwrite the root
 
-        Disk_Write(ROOT_INODE_OFFSET, (char*)inodeBlock);
-        Disk_Write(directorySector, (char*)directoryBlock);
+        Inode* root = inodeGet(0);
+        root->fileType = 1; //directory
+        root->fileSize = 0; //nothing in it
+        root->pointers[0] = directorySector;
+        inodeDirty(0);
+
+        bufferWrite(directorySector, (char*)directoryBlock);
     }
     else //otherwise, start at the root and find the appropriate spot
     {
         int newInodeNum = findFirstAvailableInode();
-        int newInodeSector = (newInodeNum / NUM_INODES_PER_BLOCK) + ROOT_INODE_OFFSET;
-        Disk_Read(newInodeSector, (char*)inodeBlock);
-        inodeBlock[newInodeNum % NUM_INODES_PER_BLOCK].fileType = 1; //update the appropriate part of the inode block
-        inodeBlock[newInodeNum % NUM_INODES_PER_BLOCK].fileSize = 0;
-        inodeBlock[newInodeNum % NUM_INODES_PER_BLOCK].pointers[0] = directorySector;
+        if (newInodeNum == -1)
+        {
+            releaseDataSector(directorySector);
+            free(directoryBlock);
+            osErrno = E_CREATE;
+            return -1;
+        }
 
         int parentInodeNum = searchInodeForPath(0, pathVec, 0);
         if (parentInodeNum == -1)
         {
+            releaseInode(newInodeNum);
+            releaseDataSector(directorySector);
+            free(directoryBlock);
             osErrno = E_CREATE;
             return -1;
         }
@@ -622,27 +2357,41 @@ int Dir_Create(char *path)
         bool alreadyExists = directoryContainsName(parentInodeNum, pathVec.at(pathVec.size() - 1));
         if (alreadyExists)
         {
+            releaseInode(newInodeNum);
+            releaseDataSector(directorySector);
+            free(directoryBlock);
             osErrno = E_CREATE;
             return -1;
         }
 
-        insertDirectoryEntry(pathVec, parentInodeNum, newInodeNum);
+        if (insertDirectoryEntry(pathVec, parentInodeNum, newInodeNum) == -1)
+        {
+            releaseInode(newInodeNum);
+            releaseDataSector(directorySector);
+            free(directoryBlock);
+            osErrno = E_CREATE;
+            return -1;
+        }
 
         //By this point, a directory entry for c has been entered into b's directory record
-        //All that's left to do is write the inode and directory entry for the new directory
-        Disk_Write(newInodeSector, (char*)inodeBlock);
-        Disk_Write(directorySector, (char*)directoryBlock);
+        //All that's left to do is fill in the inode and write the directory entry for the new directory
+        Inode* newNode = inodeGet(newInodeNum);
+        newNode->fileType = 1;
+        newNode->fileSize = 0;
+        newNode->pointers[0] = directorySector;
+        inodeDirty(newInodeNum);
+        bufferWrite(directorySector, (char*)directoryBlock);
     }
+    free(directoryBlock);
 
     totalFilesAndDirectories++;
+    journalEndOp();
     return 0;
 }
 
 void validateRoot()
 {
-    Inode* rootBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
-    Disk_Read(ROOT_INODE_OFFSET, (char*)rootBlock);
-    Inode rootNode = rootBlock[0];
+    Inode rootNode = *inodeGet(0);
     std::cout << "Root block filetype " << rootNode.fileType << " with pointers:\n";
     for (int i = 0; i < NUM_POINTERS; i++)
     {
@@ -653,15 +2402,19 @@ void validateRoot()
 
 void printInodes()
 {
-    Inode* inodeBlock = (Inode*)calloc(NUM_INODES_PER_BLOCK, sizeof(Inode));
+    //pull in the whole inode table at once, after putting back what's only changed in the caches
+    cacheFlush();
+    int tableSectors = (layout.numInodes + inodesPerBlock - 1) / inodesPerBlock;
+    std::vector<Inode> inodeTable(tableSectors * inodesPerBlock);
+    Disk_ReadRange(layout.inodeTableStart, tableSectors, (char*)inodeTable.data());
 
-    for (int i = ROOT_INODE_OFFSET; i < FIRST_DATABLOCK_OFFSET; i++)
+    for (int i = layout.inodeTableStart; i < layout.inodeTableStart + tableSectors; i++)
     {
-        Disk_Read(i, (char*)inodeBlock);
-        for (int j = 0; j < NUM_INODES_PER_BLOCK; j++)
+        Inode* inodeBlock = &inodeTable[(i - layout.inodeTableStart) * inodesPerBlock];
+        for (int j = 0; j < inodesPerBlock; j++)
         {
             Inode curNode = inodeBlock[j];
-            if (curNode.fileType == 1)
+            if (curNode.fileType != 0)
             {
                 std::cout << "Directory at inode #" << i << " with pointers:\n";
                 for (int k = 0; k < NUM_POINTERS; k++)
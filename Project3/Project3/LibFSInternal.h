@@ -0,0 +1,12 @@
+#ifndef __LibFSInternal_h__
+#define __LibFSInternal_h__
+
+//the parts of LibFS.cc that aren't in the API (LibFS.h) but that the benchmarks
+//get at directly; only LibFS.cc defines them
+
+//the allocators, which pick a free bit the way FS_ALLOC_POLICY says and mark it used
+int findFirstAvailableInode();
+int findFirstAvailableDataSector(int goal = -1); //near after goal, -1 for none
+void markDataSector(int sector, bool used);
+
+#endif
@@ -0,0 +1,88 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <stdio.h>
+
+#include "LibFS.h"
+#include "LibFSInternal.h"
+
+// times the data block allocator filling an empty bitmap, then churning on one
+// that stays 99% full (free a random block, allocate one); build LibFS.cc and
+// this with the same -DFS_ALLOC_POLICY=FirstFit, NextFit or GoalDirected to
+// compare the placement policies
+// usage: allocBench <scratch image path> [sectors]
+
+#define STRINGIFY(x) #x
+#define NAME(x) STRINGIFY(x)
+#ifndef FS_ALLOC_POLICY
+#define FS_ALLOC_POLICY NextFit
+#endif
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: allocBench <scratch image path> [sectors]" << std::endl;
+        return 1;
+    }
+    char* imagePath = argv[1];
+    int sectors = (argc > 2) ? atoi(argv[2]) : 262144;
+    int churn = 2000000;
+
+    if (FS_Format(imagePath, 512, sectors) == -1)
+    {
+        std::cout << "format failed, osErrno " << osErrno << std::endl;
+        return 1;
+    }
+
+    //fill it up, the way a big file grows: each block asks to go after the last one
+    std::vector<int> blocks;
+    int last = -1;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    while ((last = findFirstAvailableDataSector(last == -1 ? -1 : last + 1)) != -1)
+    {
+        blocks.push_back(last);
+    }
+    double fill = secondsSince(start);
+    size_t total = blocks.size();
+
+    //free a random 1%, then keep it there: every allocation pays for one random free
+    unsigned int seed = 1;
+    std::vector<int> freed;
+    for (size_t i = 0; i < blocks.size() / 100; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        size_t pick = (seed >> 4) % blocks.size();
+        markDataSector(blocks[pick], false);
+        freed.push_back(blocks[pick]);
+        blocks[pick] = blocks.back();
+        blocks.pop_back();
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < churn; i++)
+    {
+        last = findFirstAvailableDataSector(last + 1);
+        if (last == -1)
+        {
+            std::cout << "ran out of blocks" << std::endl;
+            return 1;
+        }
+        seed = seed * 1103515245 + 12345;
+        size_t pick = (seed >> 4) % blocks.size();
+        markDataSector(blocks[pick], false);
+        blocks[pick] = last;
+    }
+    double steady = secondsSince(start);
+
+    std::cout << NAME(FS_ALLOC_POLICY) << ", " << total << " blocks" << std::endl;
+    std::cout << "fill: " << total / fill / 1e6 << " M allocs/s" << std::endl;
+    std::cout << "99% full: " << churn / steady / 1e6 << " M allocs/s" << std::endl;
+    remove(imagePath);
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#include "LibDisk.h"
+
+// times Disk_Read with checksum verification on and off (Disk_SetVerifyReads).
+// With it on, the first pass after a load checks every sector and later passes
+// don't check again, so it prints what that first pass costs, what a later
+// pass costs (the median of passes taking turns on and off), and the two
+// together over the whole run
+// usage: checksumBench <scratch image path> [passes]
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double readPasses(int sectors, int passes, char* buffer)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < passes; pass++)
+    {
+        for (int i = 0; i < sectors; i++)
+        {
+            if (Disk_Read(i, buffer) == -1)
+            {
+                std::cout << "read failed, diskErrno " << diskErrno << std::endl;
+                exit(1);
+            }
+        }
+    }
+    return secondsSince(start);
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: checksumBench <scratch image path> [passes]" << std::endl;
+        return 1;
+    }
+    char* imagePath = argv[1];
+    int passes = (argc > 2) ? std::max(2, atoi(argv[2])) : 20;
+    int sectors = 65536;
+    int runs = 5; //best of, to keep other processes out of it
+
+    Disk_InitGeometry(SECTOR_SIZE, sectors);
+    std::vector<char> buffer(SECTOR_SIZE);
+    for (int i = 0; i < sectors; i++)
+    {
+        memset(buffer.data(), i, SECTOR_SIZE);
+        Disk_Write(i, buffer.data());
+    }
+    if (Disk_Save(imagePath) == -1)
+    {
+        std::cout << "save failed, diskErrno " << diskErrno << std::endl;
+        return 1;
+    }
+
+    //a disk straight after a load, read once: with verification on, every sector gets checked
+    double offFirst = 1e9;
+    double onFirst = 1e9;
+    for (int run = 0; run < runs; run++)
+    {
+        Disk_SetVerifyReads(0);
+        Disk_Load(imagePath);
+        offFirst = std::min(offFirst, readPasses(sectors, 1, buffer.data()));
+
+        Disk_SetVerifyReads(1);
+        Disk_Load(imagePath);
+        onFirst = std::min(onFirst, readPasses(sectors, 1, buffer.data()));
+    }
+    remove(imagePath);
+
+    //after that, passes taking turns with verification on and off
+    std::vector<double> off;
+    std::vector<double> on;
+    for (int pass = 0; pass < 2 * (passes - 1); pass++)
+    {
+        Disk_SetVerifyReads(pass % 2);
+        (pass % 2 ? on : off).push_back(readPasses(sectors, 1, buffer.data()));
+    }
+    std::sort(off.begin(), off.end());
+    std::sort(on.begin(), on.end());
+    double offRest = off[off.size() / 2];
+    double onRest = on[on.size() / 2];
+
+    double megabytes = (double) sectors * SECTOR_SIZE / (1024 * 1024);
+    std::cout << "first pass:   " << megabytes / offFirst << " MB/s unchecked, " << megabytes / onFirst << " MB/s checked ("
+              << (onFirst / offFirst - 1) * 100 << "% slower)" << std::endl;
+    std::cout << "later passes: " << megabytes / offRest << " MB/s unchecked, " << megabytes / onRest << " MB/s checked ("
+              << (onRest / offRest - 1) * 100 << "% slower)" << std::endl;
+    std::cout << "all " << passes << " passes: "
+              << ((onFirst + onRest * (passes - 1)) / (offFirst + offRest * (passes - 1)) - 1) * 100 << "% slower with checksums" << std::endl;
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <iostream>
+#include <string.h>
+
+#include "LibDisk.h"
+#include "LibFS.h"
+
+// formats an image and boots it again in a second run, the way a fresh disk
+// is first used: the root must still own its inode and its data block there,
+// so creating under it works and nothing written lands on top of it
+// usage: formatCheck <scratch image path> format [sector size] [sectors]
+//        formatCheck <scratch image path> boot
+
+static int fail(const char* what)
+{
+    std::cout << "format check failed: " << what << " (osErrno " << osErrno << ")" << std::endl;
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3)
+    {
+        std::cout << "usage: formatCheck <scratch image path> format [sector size] [sectors]" << std::endl;
+        std::cout << "       formatCheck <scratch image path> boot" << std::endl;
+        return 1;
+    }
+    char* imagePath = argv[1];
+
+    if (strcmp(argv[2], "format") == 0)
+    {
+        int sectorSize = (argc > 3) ? atoi(argv[3]) : SECTOR_SIZE;
+        int sectors = (argc > 4) ? atoi(argv[4]) : NUM_SECTORS;
+        remove(imagePath);
+        if (FS_Format(imagePath, sectorSize, sectors) == -1)
+        {
+            return fail("FS_Format");
+        }
+        return 0;
+    }
+
+    if (FS_Boot(imagePath) == -1)
+    {
+        return fail("FS_Boot");
+    }
+    if (Dir_Create("/d") == -1)
+    {
+        return fail("Dir_Create /d");
+    }
+    if (File_Create("/d/a") == -1)
+    {
+        return fail("File_Create /d/a");
+    }
+    if (Dir_Create("/e") == -1 || File_Create("/e/b") == -1)
+    {
+        return fail("creating /e/b");
+    }
+
+    char buffer[2000];
+    memset(buffer, 'x', sizeof(buffer));
+    int fd = File_Open("/d/a");
+    if (fd == -1 || File_Write(fd, buffer, sizeof(buffer)) != sizeof(buffer) || File_Close(fd) == -1)
+    {
+        return fail("writing /d/a");
+    }
+
+    //the root's block must not have been handed to that data: everything is still listed
+    if (Dir_Create("/d") != -1 || File_Create("/e/b") != -1)
+    {
+        return fail("/d and /e/b should already be there");
+    }
+
+    std::cout << "format check ok" << std::endl;
+    return 0;
+}
@@ -9,8 +9,6 @@
 #include	"LibFS.h"
 #include	"LibDisk.h"
 
-extern Disk_Error_t diskErrno;
-
 void
 usage( char *image )
 {
@@ -0,0 +1,68 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <string.h>
+
+#include "LibDisk.h"
+
+// saves and loads a 256MB disk with 1, 2, 4... threads and prints the
+// throughput Disk_GetStats reports for each; it goes up to at least 4 threads,
+// though on fewer cores the extra ones can only overlap their file I/O
+// usage: saveBench <scratch image path> [max threads]
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2)
+    {
+        std::cout << "usage: saveBench <scratch image path> [max threads]" << std::endl;
+        return 1;
+    }
+    char* imagePath = argv[1];
+    int cores = (int) std::thread::hardware_concurrency();
+    int maxThreads = (argc > 2) ? atoi(argv[2]) : std::max(4, cores);
+    int sectorSize = 4096;
+    int sectors = 65536;
+
+    Disk_InitGeometry(sectorSize, sectors);
+    std::cout << cores << " cores" << std::endl;
+    std::vector<char> buffer(sectorSize);
+    unsigned int seed = 1;
+    for (int i = 0; i < sectors; i++)
+    {
+        for (int j = 0; j < sectorSize; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            buffer[j] = (char)(seed >> 16);
+        }
+        Disk_Write(i, buffer.data());
+    }
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        Disk_SetImageThreads(threads);
+        Disk_Stats stats;
+
+        Disk_ResetStats();
+        if (Disk_Save(imagePath) == -1)
+        {
+            std::cout << "save failed, diskErrno " << diskErrno << std::endl;
+            return 1;
+        }
+        Disk_GetStats(&stats);
+        double save = stats.imageBytes / stats.imageTime / (1024 * 1024);
+
+        Disk_ResetStats();
+        if (Disk_Load(imagePath) == -1)
+        {
+            std::cout << "load failed, diskErrno " << diskErrno << std::endl;
+            return 1;
+        }
+        Disk_GetStats(&stats);
+        double load = stats.imageBytes / stats.imageTime / (1024 * 1024);
+
+        std::cout << threads << " threads: save " << save << " MB/s, load " << load << " MB/s" << std::endl;
+    }
+    remove(imagePath);
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <string.h>
+
+#include "LibDisk.h"
+
+// saves and loads a 64MB disk striped over 1, 2, 4... files and prints the
+// bandwidth of each; put the directories on different devices to see it scale
+// usage: stripeBench <directory> [more directories...]
+
+static double secondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char* argv[])
+{
+    int sectorSize = 4096;
+    int sectors = 16384;
+    int stripeSectors = 64;
+    int maxFiles = (argc > 1) ? argc - 1 : 1;
+
+    Disk_InitGeometry(sectorSize, sectors);
+    std::vector<char> buffer(sectorSize);
+    unsigned int seed = 1;
+    for (int i = 0; i < sectors; i++)
+    {
+        for (int j = 0; j < sectorSize; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            buffer[j] = (char)(seed >> 16);
+        }
+        Disk_Write(i, buffer.data());
+    }
+    double megabytes = (double) sectors * sectorSize / (1024 * 1024);
+
+    for (int files = 1; files <= maxFiles; files *= 2)
+    {
+        //one file per directory, going round the list
+        std::vector<std::string> names;
+        std::vector<char*> paths;
+        for (int i = 0; i < files; i++)
+        {
+            std::string dir = (argc > 1) ? argv[1 + i % (argc - 1)] : ".";
+            names.push_back(dir + "/stripe" + std::to_string(i) + ".img");
+        }
+        for (int i = 0; i < files; i++)
+        {
+            paths.push_back((char*) names[i].c_str());
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        if (Disk_SaveStriped(paths.data(), files, stripeSectors) == -1)
+        {
+            std::cout << "save failed, diskErrno " << diskErrno << std::endl;
+            return 1;
+        }
+        double save = secondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        if (Disk_LoadStriped(paths.data(), files, stripeSectors) == -1)
+        {
+            std::cout << "load failed, diskErrno " << diskErrno << std::endl;
+            return 1;
+        }
+        double load = secondsSince(start);
+
+        std::cout << files << " files: save " << megabytes / save << " MB/s, load " << megabytes / load << " MB/s" << std::endl;
+        for (int i = 0; i < files; i++)
+        {
+            remove(paths[i]);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,81 @@
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <string.h>
+
+#include "LibDisk.h"
+
+// hammers the disk with a read-mostly mix of single-sector I/O from 1, 2, 4...
+// threads and prints the throughput for each, plus any torn sectors seen
+// (every write fills a whole sector with one byte value, so a reader that
+// finds two different bytes in a sector caught a write half done). It goes up
+// to at least 4 threads even on fewer cores, where the extra threads only
+// measure contention; it takes as many cores as threads to see it scale
+// usage: threadBench [max threads]
+
+static std::atomic<long long> tornReads(0);
+
+static void worker(int id, int sectors, int operations)
+{
+    std::vector<char> buffer(SECTOR_SIZE);
+    unsigned int seed = 12345 + id * 7919;
+
+    for (int op = 0; op < operations; op++)
+    {
+        seed = seed * 1103515245 + 12345;
+        int sector = (seed >> 8) % sectors;
+        if ((seed >> 4) % 10 == 0)
+        {
+            memset(buffer.data(), (char) op, SECTOR_SIZE);
+            Disk_Write(sector, buffer.data());
+        }
+        else
+        {
+            Disk_Read(sector, buffer.data());
+            for (int i = 1; i < SECTOR_SIZE; i++)
+            {
+                if (buffer[i] != buffer[0])
+                {
+                    tornReads++;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    int cores = (int) std::thread::hardware_concurrency();
+    int maxThreads = (argc > 1) ? atoi(argv[1]) : std::max(4, cores);
+    int sectors = 65536;
+    int operations = 2000000;
+
+    Disk_InitGeometry(SECTOR_SIZE, sectors);
+    std::cout << cores << " cores" << std::endl;
+
+    for (int threads = 1; threads <= maxThreads; threads *= 2)
+    {
+        std::vector<std::thread> pool;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < threads; i++)
+        {
+            pool.push_back(std::thread(worker, i, sectors, operations / threads));
+        }
+        for (int i = 0; i < threads; i++)
+        {
+            pool[i].join();
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << threads << " threads: " << operations / seconds / 1e6 << " M ops/s" << std::endl;
+    }
+
+    Disk_Stats stats;
+    Disk_GetStats(&stats);
+    std::cout << "reads " << stats.reads << " writes " << stats.writes << ", torn reads " << tornReads << std::endl;
+    return 0;
+}